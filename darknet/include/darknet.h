@@ -516,6 +516,10 @@ typedef struct {
     float *data;
 } image;
 
+typedef enum {
+    RESIZE_BILINEAR, RESIZE_AREA
+} RESIZE_MODE;
+
 typedef struct{
     float x, y, w, h;
 } box;
@@ -683,6 +687,7 @@ int option_find_int(list *l, char *key, int def);
 int option_find_int_quiet(list *l, char *key, int def);
 
 network *parse_network_cfg(char *filename);
+network *parse_network_cfg_batch(char *filename, int batch);
 void save_weights(network *net, char *filename);
 void load_weights(network *net, char *filename);
 void save_weights_upto(network *net, char *filename, int cutoff);
@@ -691,15 +696,27 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff);
 void zero_objectness(layer l);
 void get_region_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, float tree_thresh, int relative, detection *dets);
 int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets);
+int get_yolo_detections_batch(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets, int batch);
 void free_network(network *net);
+void share_network_weights(network *dst, network *src);
+void free_shared_network(network *net, network *src);
+size_t get_network_workspace_size(network *net);
+void set_network_workspace(network *net, float *workspace);
 void set_batch_network(network *net, int b);
 void set_temp_network(network *net, float t);
 image load_image(char *filename, int w, int h, int c);
 image load_image_color(char *filename, int w, int h);
 image make_image(int w, int h, int c);
 image resize_image(image im, int w, int h);
+void resize_image_into(image im, image out, RESIZE_MODE mode);
+void resize_image_rect(image im, image out, int dx, int dy, int w, int h, RESIZE_MODE mode);
+void resize_crop_into(image im, int sx, int sy, int sw, int sh, image out, int dx, int dy, int w, int h, RESIZE_MODE mode);
+void resize_image_rows(image im, int sx, int sy, int sw, int sh, image out, int dx, int dy, int w, int h, RESIZE_MODE mode, int first, int last);
 void censor_image(image im, int dx, int dy, int w, int h);
 image letterbox_image(image im, int w, int h);
+void letterbox_image_into(image im, int w, int h, image boxed);
+void letterbox_image_into_mode(image im, int w, int h, image boxed, RESIZE_MODE mode);
+void letterbox_crop_into(image im, int sx, int sy, int sw, int sh, int w, int h, image boxed, RESIZE_MODE mode);
 image crop_image(image im, int dx, int dy, int w, int h);
 image center_crop_image(image im, int w, int h);
 image resize_min(image im, int min);
@@ -748,6 +765,7 @@ int network_height(network *net);
 float *network_predict_image(network *net, image im);
 void network_detect(network *net, image im, float thresh, float hier_thresh, float nms, detection *dets);
 detection *get_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, int *num);
+detection *get_network_boxes_batch(network *net, int batch, int w, int h, float thresh, float hier, int *map, int relative, int *num);
 void free_detections(detection *dets, int n);
 
 void reset_network_state(network *net, int b);
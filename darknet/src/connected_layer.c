@@ -35,6 +35,8 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     l.weight_updates = calloc(inputs*outputs, sizeof(float));
     l.bias_updates = calloc(outputs, sizeof(float));
 
+    l.nweights = outputs*inputs;
+    l.nbiases = outputs;
     l.weights = calloc(outputs*inputs, sizeof(float));
     l.biases = calloc(outputs, sizeof(float));
 
@@ -67,11 +67,6 @@ static void set_pixel(image m, int x, int y, int c, float val)
     assert(x < m.w && y < m.h && c < m.c);
     m.data[c*m.h*m.w + y*m.w + x] = val;
 }
-static void add_pixel(image m, int x, int y, int c, float val)
-{
-    assert(x < m.w && y < m.h && c < m.c);
-    m.data[c*m.h*m.w + y*m.w + x] += val;
-}
 
 static float bilinear_interpolate(image im, float x, float y, int c)
 {
@@ -427,13 +422,13 @@ void censor_image(image im, int dx, int dy, int w, int h)
 
 void embed_image(image source, image dest, int dx, int dy)
 {
-    int x,y,k;
-    for(k = 0; k < source.c; ++k){
-        for(y = 0; y < source.h; ++y){
-            for(x = 0; x < source.w; ++x){
-                float val = get_pixel(source, x,y,k);
-                set_pixel(dest, dx+x, dy+y, k, val);
-            }
+    int x0 = dx < 0 ? -dx : 0, x1 = dx + source.w > dest.w ? dest.w - dx : source.w;
+    int y0 = dy < 0 ? -dy : 0, y1 = dy + source.h > dest.h ? dest.h - dy : source.h;
+    int y,k;
+    if(x1 <= x0) return;
+    for(k = 0; k < source.c && k < dest.c; ++k){
+        for(y = y0; y < y1; ++y){
+            memcpy(dest.data + x0+dx + dest.w*(y+dy + dest.h*k), source.data + x0 + source.w*(y + source.h*k), (x1-x0)*sizeof(float));
         }
     }
 }
@@ -945,40 +940,34 @@ void composite_3d(char *f1, char *f2, char *out, int delta)
 #endif
 }
 
-void letterbox_image_into(image im, int w, int h, image boxed)
+void letterbox_crop_into(image im, int sx, int sy, int sw, int sh, int w, int h, image boxed, RESIZE_MODE mode)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w/im.w) < ((float)h/im.h)) {
+    int new_w, new_h;
+    if (((float)w/sw) < ((float)h/sh)) {
         new_w = w;
-        new_h = (im.h * w)/im.w;
+        new_h = (sh * w)/sw;
     } else {
         new_h = h;
-        new_w = (im.w * h)/im.h;
+        new_w = (sw * h)/sh;
     }
-    image resized = resize_image(im, new_w, new_h);
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2); 
-    free_image(resized);
+    resize_crop_into(im, sx, sy, sw, sh, boxed, (w-new_w)/2, (h-new_h)/2, new_w, new_h, mode);
+}
+
+void letterbox_image_into_mode(image im, int w, int h, image boxed, RESIZE_MODE mode)
+{
+    letterbox_crop_into(im, 0, 0, im.w, im.h, w, h, boxed, mode);
+}
+
+void letterbox_image_into(image im, int w, int h, image boxed)
+{
+    letterbox_image_into_mode(im, w, h, boxed, RESIZE_BILINEAR);
 }
 
 image letterbox_image(image im, int w, int h)
 {
-    int new_w = im.w;
-    int new_h = im.h;
-    if (((float)w/im.w) < ((float)h/im.h)) {
-        new_w = w;
-        new_h = (im.h * w)/im.w;
-    } else {
-        new_h = h;
-        new_w = (im.w * h)/im.h;
-    }
-    image resized = resize_image(im, new_w, new_h);
     image boxed = make_image(w, h, im.c);
     fill_image(boxed, .5);
-    //int i;
-    //for(i = 0; i < boxed.w*boxed.h*boxed.c; ++i) boxed.data[i] = 0;
-    embed_image(resized, boxed, (w-new_w)/2, (h-new_h)/2); 
-    free_image(resized);
+    letterbox_image_into(im, w, h, boxed);
     return boxed;
 }
 
@@ -1348,47 +1337,116 @@ void saturate_exposure_image(image im, float sat, float exposure)
     constrain_image(im);
 }
 
-image resize_image(image im, int w, int h)
+static int resize_taps(int in, int out, RESIZE_MODE mode, int lo, int hi, int *first, float *weights)
 {
-    image resized = make_image(w, h, im.c);   
-    image part = make_image(w, im.h, im.c);
-    int r, c, k;
-    float w_scale = (float)(im.w - 1) / (w - 1);
-    float h_scale = (float)(im.h - 1) / (h - 1);
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < im.h; ++r){
-            for(c = 0; c < w; ++c){
-                float val = 0;
-                if(c == w-1 || im.w == 1){
-                    val = get_pixel(im, im.w-1, r, k);
-                } else {
-                    float sx = c*w_scale;
-                    int ix = (int) sx;
-                    float dx = sx - ix;
-                    val = (1 - dx) * get_pixel(im, ix, r, k) + dx * get_pixel(im, ix+1, r, k);
-                }
-                set_pixel(part, c, r, k, val);
+    // filter for output samples lo..hi-1 of in scaled to out: n weights each (returned), from first[i-lo] on, any
+    // beyond the last sample weighted 0.  bilinear keeps the corners on each other as resize_image always has,
+    // area averages what each output sample covers when shrinking
+    int i, j;
+    if(mode == RESIZE_AREA && in > out){
+        int n = (in + out - 1)/out + 1;
+        float scale = (float)in/out;
+        for(i = lo; i < hi; ++i){
+            float x0 = i*scale, x1 = x0 + scale;
+            int s = (int)x0;
+            float *w = weights + (i-lo)*n;
+            first[i-lo] = s;
+            for(j = 0; j < n; ++j){
+                float a = s+j > x0 ? s+j : x0;
+                float b = s+j+1 < x1 ? s+j+1 : x1;
+                w[j] = s+j < in && b > a ? (b - a)/scale : 0;
             }
         }
-    }
-    for(k = 0; k < im.c; ++k){
-        for(r = 0; r < h; ++r){
-            float sy = r*h_scale;
-            int iy = (int) sy;
-            float dy = sy - iy;
-            for(c = 0; c < w; ++c){
-                float val = (1-dy) * get_pixel(part, c, iy, k);
-                set_pixel(resized, c, r, k, val);
+        return n;
+    }
+    float scale = out > 1 ? (float)(in - 1)/(out - 1) : 0;
+    for(i = lo; i < hi; ++i){
+        float sx = i*scale;
+        int ix = (int)sx;
+        float d = sx - ix;
+        if(i == out-1 || ix >= in-1){
+            ix = in-1;
+            d = 0;
+        }
+        first[i-lo] = ix;
+        weights[(i-lo)*2] = 1-d;
+        weights[(i-lo)*2+1] = d;
+    }
+    return 2;
+}
+
+void resize_image_rows(image im, int sx, int sy, int sw, int sh, image out, int dx, int dy, int w, int h, RESIZE_MODE mode, int first, int last)
+{
+    // resize the sw x sh window of im at sx,sy (which must be inside im) to w x h at dx,dy in out (clipped to it),
+    // doing only rows first..last-1 of the resized image so that threads can split the work.  each row blends the source rows it needs into one, then filters that
+    // across with the precomputed taps: both loops run over contiguous floats so the compiler vectorizes them
+    int x0 = dx < 0 ? -dx : 0, x1 = dx + w > out.w ? out.w - dx : w;
+    int c = im.c < out.c ? im.c : out.c;
+    int x, y, k, t;
+    if(first < -dy) first = -dy;
+    if(last > h) last = h;
+    if(last > out.h - dy) last = out.h - dy;
+    if(x1 <= x0 || last <= first) return;
+    int nx = mode == RESIZE_AREA && sw > w ? (sw + w - 1)/w + 1 : 2;
+    int ny = mode == RESIZE_AREA && sh > h ? (sh + h - 1)/h + 1 : 2;
+
+    int fx[x1-x0];
+    float wx[(x1-x0)*nx];
+    float wy[ny];
+    float row[sw + nx];
+    resize_taps(sw, w, mode, x0, x1, fx, wx);
+    for(x = sw; x < sw + nx; ++x) row[x] = 0;
+    for(y = first; y < last; ++y){
+        int fy;
+        resize_taps(sh, h, mode, y, y+1, &fy, wy);
+        int n = fy + ny > sh ? sh - fy : ny;
+        for(k = 0; k < c; ++k){
+            float *src = im.data + sx + im.w*(sy+fy + im.h*k);
+            float *dst = out.data + dx + out.w*(y+dy + out.h*k);
+            for(x = 0; x < sw; ++x) row[x] = wy[0]*src[x];
+            for(t = 1; t < n; ++t){
+                if(wy[t] == 0) continue;
+                for(x = 0; x < sw; ++x) row[x] += wy[t]*src[t*im.w + x];
             }
-            if(r == h-1 || im.h == 1) continue;
-            for(c = 0; c < w; ++c){
-                float val = dy * get_pixel(part, c, iy+1, k);
-                add_pixel(resized, c, r, k, val);
+            if(nx == 2){
+                for(x = x0; x < x1; ++x){
+                    float *w2 = wx + (x-x0)*2;
+                    dst[x] = w2[0]*row[fx[x-x0]] + w2[1]*row[fx[x-x0]+1];
+                }
+            } else {
+                for(x = x0; x < x1; ++x){
+                    float *r = row + fx[x-x0], *wn = wx + (x-x0)*nx, val = 0;
+                    for(t = 0; t < nx; ++t) val += wn[t]*r[t];
+                    dst[x] = val;
+                }
             }
         }
     }
+}
 
-    free_image(part);
+void resize_crop_into(image im, int sx, int sy, int sw, int sh, image out, int dx, int dy, int w, int h, RESIZE_MODE mode)
+{
+    int i, rows = 16;
+    #pragma omp parallel for
+    for(i = 0; i < (h + rows - 1)/rows; ++i){
+        resize_image_rows(im, sx, sy, sw, sh, out, dx, dy, w, h, mode, i*rows, (i+1)*rows);
+    }
+}
+
+void resize_image_rect(image im, image out, int dx, int dy, int w, int h, RESIZE_MODE mode)
+{
+    resize_crop_into(im, 0, 0, im.w, im.h, out, dx, dy, w, h, mode);
+}
+
+void resize_image_into(image im, image out, RESIZE_MODE mode)
+{
+    resize_image_rect(im, out, 0, 0, out.w, out.h, mode);
+}
+
+image resize_image(image im, int w, int h)
+{
+    image resized = make_image(w, h, im.c);
+    resize_image_into(im, resized, RESIZE_BILINEAR);
     return resized;
 }
 
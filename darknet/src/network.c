@@ -566,6 +566,49 @@ detection *get_network_boxes(network *net, int w, int h, float thresh, float hie
     return dets;
 }
 
+int num_detections_batch(network *net, float thresh, int batch)
+{
+    int i;
+    int s = 0;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == YOLO){
+            s += yolo_num_detections_batch(l, thresh, batch);
+        }
+    }
+    return s;
+}
+
+void fill_network_boxes_batch(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets, int batch)
+{
+    int j;
+    for(j = 0; j < net->n; ++j){
+        layer l = net->layers[j];
+        if(l.type == YOLO){
+            int count = get_yolo_detections_batch(l, w, h, net->w, net->h, thresh, map, relative, dets, batch);
+            dets += count;
+        }
+    }
+}
+
+detection *get_network_boxes_batch(network *net, int batch, int w, int h, float thresh, float hier, int *map, int relative, int *num)
+{
+    // boxes for image batch of the last forward pass, only YOLO layers support this
+    layer l = net->layers[net->n - 1];
+    int i;
+    int nboxes = num_detections_batch(net, thresh, batch);
+    if(num) *num = nboxes;
+    detection *dets = calloc(nboxes, sizeof(detection));
+    for(i = 0; i < nboxes; ++i){
+        dets[i].prob = calloc(l.classes, sizeof(float));
+        if(l.coords > 4){
+            dets[i].mask = calloc(l.coords-4, sizeof(float));
+        }
+    }
+    fill_network_boxes_batch(net, w, h, thresh, hier, map, relative, dets, batch);
+    return dets;
+}
+
 void free_detections(detection *dets, int n)
 {
     int i;
@@ -729,6 +772,90 @@ void free_network(network *net)
     free(net);
 }
 
+/* Point the parameters of dst at those of src (which must be built from the
+ * same cfg) so several networks can run inference with one copy of the
+ * weights.  dst keeps its own outputs and workspace. */
+void share_network_weights(network *dst, network *src)
+{
+    int i;
+    for(i = 0; i < dst->n && i < src->n; ++i){
+        layer *l = dst->layers + i;
+        layer *s = src->layers + i;
+        if(l->type != s->type || l->nweights != s->nweights) continue;
+#define SHARE(f) if(l->f && s->f && l->f != s->f){ free(l->f); l->f = s->f; }
+        SHARE(weights);
+        SHARE(biases);
+        SHARE(scales);
+        SHARE(rolling_mean);
+        SHARE(rolling_variance);
+#undef SHARE
+#ifdef GPU
+#define SHARE_GPU(f) if(l->f && s->f && l->f != s->f){ cuda_free(l->f); l->f = s->f; }
+        SHARE_GPU(weights_gpu);
+        SHARE_GPU(biases_gpu);
+        SHARE_GPU(scales_gpu);
+        SHARE_GPU(rolling_mean_gpu);
+        SHARE_GPU(rolling_variance_gpu);
+#undef SHARE_GPU
+#endif
+    }
+}
+
+/* Free a network set up with share_network_weights without touching the
+ * parameters it borrowed. */
+void free_shared_network(network *net, network *src)
+{
+    int i;
+    for(i = 0; i < net->n && i < src->n; ++i){
+        layer *l = net->layers + i;
+        layer *s = src->layers + i;
+        if(l->weights == s->weights) l->weights = 0;
+        if(l->biases == s->biases) l->biases = 0;
+        if(l->scales == s->scales) l->scales = 0;
+        if(l->rolling_mean == s->rolling_mean) l->rolling_mean = 0;
+        if(l->rolling_variance == s->rolling_variance) l->rolling_variance = 0;
+#ifdef GPU
+        if(l->weights_gpu == s->weights_gpu) l->weights_gpu = 0;
+        if(l->biases_gpu == s->biases_gpu) l->biases_gpu = 0;
+        if(l->scales_gpu == s->scales_gpu) l->scales_gpu = 0;
+        if(l->rolling_mean_gpu == s->rolling_mean_gpu) l->rolling_mean_gpu = 0;
+        if(l->rolling_variance_gpu == s->rolling_variance_gpu) l->rolling_variance_gpu = 0;
+#endif
+    }
+    free_network(net);
+}
+
+/* Bytes of scratch workspace the network's layers need (the most any one
+ * layer needs, since they run one at a time). */
+size_t get_network_workspace_size(network *net)
+{
+    int i;
+    size_t size = 0;
+    for(i = 0; i < net->n; ++i){
+        if(net->layers[i].workspace_size > size) size = net->layers[i].workspace_size;
+    }
+    return size;
+}
+
+/* Have the network use workspace, which must be at least
+ * get_network_workspace_size(net) bytes (and on the GPU if the network is),
+ * in place of its own, so networks that never run at the same time can
+ * share one.  Its own is freed.  free_network leaves the workspace alone, so
+ * the caller frees the shared one. */
+void set_network_workspace(network *net, float *workspace)
+{
+    if(net->workspace == workspace) return;
+#ifdef GPU
+    if(net->workspace){
+        if(net->gpu_index >= 0) cuda_free(net->workspace);
+        else free(net->workspace);
+    }
+#else
+    free(net->workspace);
+#endif
+    net->workspace = workspace;
+}
+
 // Some day...
 // ^ What the hell is this comment for?
 
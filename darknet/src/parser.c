@@ -740,6 +740,13 @@ int is_network(section *s)
 }
 
 network *parse_network_cfg(char *filename)
+{
+    return parse_network_cfg_batch(filename, 0);
+}
+
+/* Like parse_network_cfg, but with every layer built to take batch images
+ * at once (0 for the batch the cfg asks for). */
+network *parse_network_cfg_batch(char *filename, int batch)
 {
     list *sections = read_cfg(filename);
     node *n = sections->front;
@@ -752,6 +759,7 @@ network *parse_network_cfg(char *filename)
     list *options = s->options;
     if(!is_network(s)) error("First section must be [net] or [network]");
     parse_net_options(options, net);
+    if(batch > 0) net->batch = batch;
 
     params.h = net->h;
     params.w = net->w;
@@ -10,6 +10,7 @@ void forward_yolo_layer(const layer l, network net);
 void backward_yolo_layer(const layer l, network net);
 void resize_yolo_layer(layer *l, int w, int h);
 int yolo_num_detections(layer l, float thresh);
+int yolo_num_detections_batch(layer l, float thresh, int batch);
 
 #ifdef GPU
 void forward_yolo_layer_gpu(const layer l, network net);
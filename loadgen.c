@@ -0,0 +1,585 @@
+// Load generator for the edge server.  Replays a directory of JPEG (or raw NV21) frames at the server over HTTP
+// (a new connection per request, or keep-alive), the binary TCP protocol or UDP, from a number of concurrent
+// clients, and reports latency percentiles, goodput and error rate.
+// compile using: make loadgen
+
+// With a target rate (-r) the load is open-loop: each client has a schedule of when its requests are due, and
+// latency is measured from when a request was due rather than when it was actually sent, so a server that
+// stalls can't hide it by holding back the clients (coordinated omission).  Without -r each client sends its
+// next request as soon as it has the previous response.  -w keeps a window of requests in flight on each keep-alive
+// or binary connection instead (pipelined), sending another as each response comes back.
+
+#define VERSION "1.0"
+
+#define DEFAULT_ADDR "127.0.0.1"
+#define DEFAULT_PORT 8000
+#define DEFAULT_CLIENTS 1
+#define DEFAULT_DURATION 10 // seconds
+#define DEFAULT_TIMEOUT 10 // seconds to wait for a response
+#define UDP_PAYLOAD 1400 // bytes of request per UDP packet, after the 2 byte index
+#define BUFFER_SIZE 4096
+
+#define _GNU_SOURCE // for strcasestr
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define ERR(args ...) do{fprintf(stderr,"ERROR: "); fprintf(stderr, args);}while(0)
+#define INFO(args ...) if (verbose) fprintf(stdout, args)
+
+enum { P_HTTP, P_KEEPALIVE, P_BINARY, P_UDP };
+const char *proto_names[] = {"http", "keepalive", "binary", "udp"};
+
+// must match BinHeader/BinResponse in server.c
+#define BIN_MAGIC "EDG1"
+#define BIN_RESPONSE_MAGIC "EDR1"
+enum { BIN_JPEG, BIN_NV21, BIN_PING };
+
+typedef struct __attribute__((packed)) BinHeader {
+  char magic[4];
+  uint32_t id;
+  uint8_t type, format, flags, reserved;
+  int16_t rotation;
+  uint16_t w, h;
+  uint16_t deadline_ms;
+  uint32_t len;
+} BinHeader;
+
+typedef struct __attribute__((packed)) BinResponse {
+  char magic[4];
+  uint32_t id;
+  uint16_t status, reserved;
+  uint32_t len;
+} BinResponse;
+
+typedef struct Frame {
+  char *data;
+  int len;
+} Frame;
+
+// latency histogram, log-linear buckets as in server.c.  each client has its own, merged at the end
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS (38*HIST_SUB)
+
+typedef struct Histogram {
+  long count, sum, max;
+  long buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct Client {
+  int id;
+  int fd; // TCP connection, or UDP socket
+  char *req; // request being sent (HTTP headers and image, or binary header and image)
+  int req_size;
+  char *resp; // response being received
+  int resp_size;
+  long sent, ok, errors, timeouts, bytes_in, bytes_out; // bytes_in is image data in requests that succeeded
+  Histogram latency;
+  pthread_t thread;
+} Client;
+
+char *addr = DEFAULT_ADDR;
+int port = DEFAULT_PORT;
+int proto = P_KEEPALIVE;
+int num_clients = DEFAULT_CLIENTS;
+double rate = 0; // requests/s across all clients, 0 for closed loop
+double duration = DEFAULT_DURATION;
+int timeout = DEFAULT_TIMEOUT;
+int out_format = 2, rotation = 0, yuv_w = 0, yuv_h = 0;
+int window = 1; // requests in flight per connection
+int verbose = 0;
+Frame *frames;
+int num_frames;
+struct sockaddr_in server;
+long start_time, end_time;
+
+long now_us() {
+  // monotonic time in us
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000L + t.tv_nsec/1000;
+}
+
+void usage(char *progname) {
+  char* usage_str =
+  "     Usage: %s v%s [options] <dir or file of frames>\n"
+  "          -a    sets server address (default " DEFAULT_ADDR ")\n"
+  "          -p    sets server port (default %d)\n"
+  "          -P    sets protocol: http (connection per request), keepalive, binary or udp (default keepalive)\n"
+  "          -c    sets number of concurrent clients (default %d)\n"
+  "          -r    sets target rate in requests/s over all clients, open-loop (default 0, closed loop)\n"
+  "          -d    sets duration in seconds (default %d)\n"
+  "          -t    sets response timeout in seconds (default %d)\n"
+  "          -f    sets output format, as out_format in server (default 2)\n"
+  "          -R    sets rotation to ask server to apply (default 0)\n"
+  "          -y    frames are raw NV21 of size WxH, e.g. -y 640x480 (default JPEG)\n"
+  "          -w    sets requests kept in flight per connection, keepalive or binary closed loop (default 1)\n"
+  "          -v    verbose, print progress every second\n"
+  "          -h    prints this message\n";
+  printf(usage_str, progname, VERSION, DEFAULT_PORT, DEFAULT_CLIENTS, DEFAULT_DURATION, DEFAULT_TIMEOUT);
+}
+
+int load_frame(const char *path) {
+  // read frame file into memory.  returns -1 on error
+  FILE *f = fopen(path, "rb");
+  if (f==NULL) {
+    ERR("Can't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  Frame *fr = &frames[num_frames];
+  fr->data = malloc(len);
+  fr->len = len;
+  if (len<=0 || fread(fr->data, 1, len, f)!=(size_t)len) {
+    ERR("Can't read %s\n", path);
+    fclose(f); free(fr->data);
+    return -1;
+  }
+  fclose(f);
+  if (yuv_w && len != yuv_w*yuv_h*3/2) {
+    ERR("%s is %ld bytes, not a %dx%d NV21 frame\n", path, len, yuv_w, yuv_h);
+    free(fr->data);
+    return -1;
+  }
+  num_frames++;
+  return 0;
+}
+
+int load_frames(const char *path) {
+  // load a single file, or every .jpg/.jpeg (or .nv21/.yuv with -y) file in a directory
+  struct stat st;
+  if (stat(path, &st)<0) {
+    ERR("Can't find %s\n", path);
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    frames = calloc(1, sizeof(Frame));
+    return load_frame(path);
+  }
+  struct dirent **names;
+  int i, n = scandir(path, &names, NULL, alphasort);
+  if (n<0) {
+    ERR("Can't read directory %s\n", path);
+    return -1;
+  }
+  frames = calloc(n, sizeof(Frame));
+  for (i=0; i<n; i++) {
+    char *ext = strrchr(names[i]->d_name, '.');
+    int want = ext && (yuv_w ? !strcasecmp(ext, ".nv21") || !strcasecmp(ext, ".yuv")
+                             : !strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+    if (want) {
+      char file[PATH_MAX];
+      snprintf(file, sizeof(file), "%s/%s", path, names[i]->d_name);
+      load_frame(file);
+    }
+    free(names[i]);
+  }
+  free(names);
+  if (num_frames==0) {
+    ERR("No %s frames in %s\n", yuv_w ? "NV21" : "JPEG", path);
+    return -1;
+  }
+  return 0;
+}
+
+int hist_bucket(long us) {
+  if (us<0) us=0;
+  int shift = 63-__builtin_clzl(us|1)-HIST_SUB_BITS;
+  if (shift<0) shift=0;
+  int b = shift*HIST_SUB + (int)(us>>shift);
+  return b<HIST_BUCKETS ? b : HIST_BUCKETS-1;
+}
+
+long hist_value(int b) {
+  if (b < 2*HIST_SUB) return b;
+  int shift = b/HIST_SUB-1;
+  return ((long)(b-shift*HIST_SUB)<<shift) + (1L<<(shift-1));
+}
+
+void hist_record(Histogram *h, long us) {
+  h->buckets[hist_bucket(us)]++;
+  h->count++;
+  h->sum += us;
+  if (us > h->max) h->max = us;
+}
+
+long hist_percentile(Histogram *h, double p) {
+  long seen=0;
+  int b;
+  for (b=0; b<HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen>0 && seen >= p/100*h->count) return hist_value(b) < h->max ? hist_value(b) : h->max;
+  }
+  return h->max;
+}
+
+int build_request(Client *c, Frame *f, uint32_t id) {
+  // put request for frame f in c->req.  returns its length
+  int head;
+  if (c->req_size < f->len+BUFFER_SIZE) {
+    c->req_size = f->len+BUFFER_SIZE;
+    c->req = realloc(c->req, c->req_size);
+  }
+  if (proto==P_BINARY) {
+    BinHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BIN_MAGIC, 4);
+    h.id = id;
+    h.type = yuv_w ? BIN_NV21 : BIN_JPEG;
+    h.format = out_format;
+    h.rotation = rotation;
+    h.w = yuv_w; h.h = yuv_h;
+    h.len = f->len;
+    memcpy(c->req, &h, sizeof(h));
+    head = sizeof(h);
+  } else {
+    // the server only takes query parameters on the edge_app2/3 paths
+    const char *path = out_format==0 ? "/api/edge_app" : out_format==1 ? "/detect" : out_format==3 ? "/api/edge_app3" : "/api/edge_app2";
+    head = sprintf(c->req, "POST %s?r=%d&isyuv=%d&w=%d&h=%d HTTP/1.1\r\nHost: %s\r\nContent-Type: %s\r\n"
+                   "Connection: %s\r\nContent-Length: %d\r\n\r\n",
+                   path, rotation, yuv_w>0, yuv_w, yuv_h, addr, yuv_w ? "application/octet-stream" : "image/jpeg",
+                   proto==P_KEEPALIVE ? "keep-alive" : "close", f->len);
+  }
+  memcpy(c->req+head, f->data, f->len);
+  return head+f->len;
+}
+
+int connect_tcp(Client *c) {
+  // (re)connect client to server.  returns -1 on failure
+  if (c->fd>=0) close(c->fd);
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd<0) return -1;
+  int one=1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  struct timeval tv = {timeout, 0};
+  setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(c->fd, (struct sockaddr*)&server, sizeof(server))<0) {
+    ERR("Can't connect to %s:%d: %s\n", addr, port, strerror(errno));
+    close(c->fd); c->fd=-1;
+    return -1;
+  }
+  return 0;
+}
+
+int send_all(int fd, const char *buf, int len) {
+  while (len>0) {
+    ssize_t rv = send(fd, buf, len, MSG_NOSIGNAL);
+    if (rv<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    buf += rv; len -= rv;
+  }
+  return 0;
+}
+
+int recv_all(Client *c, int off, int len) {
+  // read exactly len bytes into c->resp at off.  returns -1 on error, -2 on timeout
+  if (c->resp_size < off+len) {
+    c->resp_size = off+len;
+    c->resp = realloc(c->resp, c->resp_size);
+  }
+  while (len>0) {
+    ssize_t rv = recv(c->fd, c->resp+off, len, 0);
+    if (rv<0 && errno==EINTR) continue;
+    if (rv<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return -2;
+    if (rv<=0) return -1;
+    off += rv; len -= rv;
+  }
+  return 0;
+}
+
+int http_response(Client *c) {
+  // read an HTTP response.  returns its status, -1 on error or -2 on timeout
+  int used=0, res;
+  char *end=NULL;
+  while (end==NULL) {
+    if (used >= BUFFER_SIZE) return -1;
+    if ((res=recv_all(c, used, 1))<0) return res; // a byte at a time, so we don't read past the headers
+    used++;
+    if (used>=4 && !memcmp(c->resp+used-4, "\r\n\r\n", 4)) end = c->resp+used;
+  }
+  c->resp[used-1] = 0;
+  int status=0;
+  sscanf(c->resp, "HTTP/1.%*d %d", &status);
+  char *cl = strcasestr(c->resp, "\r\nContent-Length:");
+  if (cl==NULL) return -1;
+  int len = atoi(cl+17);
+  if ((res=recv_all(c, 0, len))<0) return res;
+  c->bytes_out += used+len;
+  return status;
+}
+
+int binary_response(Client *c, uint32_t *id) {
+  // read a binary protocol response, setting *id to the request it answers.  returns its status, -1 on error or
+  // -2 on timeout
+  BinResponse h;
+  int res;
+  if ((res=recv_all(c, 0, sizeof(h)))<0) return res;
+  memcpy(&h, c->resp, sizeof(h));
+  *id = h.id;
+  if (memcmp(h.magic, BIN_RESPONSE_MAGIC, 4)) {
+    ERR("client %d: bad response header\n", c->id);
+    return -1;
+  }
+  if ((res=recv_all(c, 0, h.len))<0) return res;
+  c->bytes_out += sizeof(h)+h.len;
+  return h.status;
+}
+
+int udp_request(Client *c, int len) {
+  // send request as UDP packets and wait for the response.  returns 200 if ok, -1 on error or -2 on timeout
+  char pkt[UDP_PAYLOAD+2], buf[65536];
+  int i, n = (len+UDP_PAYLOAD-1)/UDP_PAYLOAD;
+  if (n > 65536) return -1;
+  // throw away extra copies of the last response
+  while (recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) ;
+  for (i=0; i<n; i++) {
+    int k = len-i*UDP_PAYLOAD < UDP_PAYLOAD ? len-i*UDP_PAYLOAD : UDP_PAYLOAD;
+    pkt[0] = i&255; pkt[1] = i>>8;
+    memcpy(pkt+2, c->req+i*UDP_PAYLOAD, k);
+    if (sendto(c->fd, pkt, k+2, 0, (struct sockaddr*)&server, sizeof(server))<0) return -1;
+  }
+  ssize_t rv = recv(c->fd, buf, sizeof(buf), 0);
+  if (rv<0) return (errno==EAGAIN || errno==EWOULDBLOCK) ? -2 : -1;
+  c->bytes_out += rv;
+  // an empty array is what the server sends when it gives up on a request
+  if (out_format>1 && out_format!=3 && rv==2 && !memcmp(buf, "[]", 2)) return 400;
+  return 200;
+}
+
+void record(Client *c, int status, Frame *f, long i, long latency) {
+  if (status==200) {
+    c->ok++;
+    c->bytes_in += f->len;
+    hist_record(&c->latency, latency);
+  } else if (status==-2) {
+    c->timeouts++;
+  } else {
+    c->errors++;
+  }
+  if (verbose>1) printf("client %d: request %ld status %d in %.1f ms\n", c->id, i, status, latency/1000.0);
+}
+
+void pipeline_client(Client *c) {
+  // closed loop with up to window requests in flight on the connection.  binary responses can come back in any
+  // order, HTTP ones come in the order the requests were sent
+  long ids[window], sent_at[window];
+  Frame *sent_frame[window];
+  int in_flight=0, j;
+  long i=0;
+  for (j=0; j<window; j++) ids[j] = -1;
+  while (1) {
+    while (in_flight<window && now_us()<end_time && (c->fd>=0 || connect_tcp(c)==0)) {
+      Frame *f = &frames[(c->id+i*num_clients)%num_frames];
+      int len = build_request(c, f, (uint32_t)i);
+      for (j=0; ids[j]>=0; j++) ;
+      ids[j] = i++; sent_at[j] = now_us(); sent_frame[j] = f;
+      in_flight++;
+      c->sent++;
+      if (send_all(c->fd, c->req, len)<0) break;
+    }
+    if (in_flight==0) {
+      if (now_us()>=end_time) break;
+      c->sent++; c->errors++; // couldn't connect
+      continue;
+    }
+    int status;
+    if (proto==P_BINARY) {
+      uint32_t id;
+      status = binary_response(c, &id);
+      for (j=0; j<window && (status<0 || ids[j]!=id); j++) ;
+      if (status>=0 && j==window) {
+        ERR("client %d: response for request %u which isn't in flight\n", c->id, id);
+        status = -1;
+      }
+    } else {
+      status = http_response(c);
+      for (j=0; j<window && ids[j]<0; j++) ; // oldest
+      int k;
+      for (k=j+1; k<window; k++) if (ids[k]>=0 && ids[k]<ids[j]) j = k;
+    }
+    if (status<0) {
+      // give up on everything in flight and reconnect
+      for (j=0; j<window; j++) {
+        if (ids[j]>=0) record(c, status, sent_frame[j], ids[j], now_us()-sent_at[j]);
+        ids[j] = -1;
+      }
+      in_flight = 0;
+      close(c->fd); c->fd=-1;
+      continue;
+    }
+    record(c, status, sent_frame[j], ids[j], now_us()-sent_at[j]);
+    ids[j] = -1;
+    in_flight--;
+  }
+}
+
+void* client_thread(void* param) {
+  Client *c = (Client*)param;
+  double interval = rate>0 ? num_clients*1e6/rate : 0; // us between this client's requests
+  long due = start_time + (rate>0 ? interval*c->id/num_clients : 0); // spread clients' schedules out
+  long i;
+  c->fd = -1;
+  if (proto==P_UDP) {
+    c->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval tv = {timeout, 0};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+  if (window>1) {
+    pipeline_client(c);
+    if (c->fd>=0) close(c->fd);
+    return NULL;
+  }
+  for (i=0; ; i++) {
+    if (rate>0) {
+      long wait = due-now_us();
+      if (wait>0) usleep(wait);
+    } else {
+      due = now_us();
+    }
+    if (due >= end_time) break;
+    Frame *f = &frames[(c->id+i*num_clients)%num_frames];
+    int len = build_request(c, f, (uint32_t)i);
+    int status = -1;
+    c->sent++;
+    if (proto==P_UDP) {
+      status = udp_request(c, len);
+    } else if ((c->fd>=0 && proto!=P_HTTP) || connect_tcp(c)==0) {
+      if (send_all(c->fd, c->req, len)==0) {
+        uint32_t id;
+        status = proto==P_BINARY ? binary_response(c, &id) : http_response(c);
+        if (proto==P_BINARY && status>=0 && id!=(uint32_t)i) {
+          ERR("client %d: bad response header\n", c->id);
+          status = -1;
+        }
+      }
+      if (status<0 || proto==P_HTTP) { close(c->fd); c->fd=-1; }
+    }
+    record(c, status, f, i, now_us()-due);
+    if (rate>0) due += interval;
+  }
+  if (c->fd>=0) close(c->fd);
+  return NULL;
+}
+
+void report(Client *clients, double secs) {
+  Histogram all;
+  long sent=0, ok=0, errors=0, timeouts=0, bytes_out=0, bytes_in=0;
+  int i, b;
+  memset(&all, 0, sizeof(all));
+  for (i=0; i<num_clients; i++) {
+    Client *c = &clients[i];
+    sent += c->sent; ok += c->ok; errors += c->errors; timeouts += c->timeouts;
+    bytes_in += c->bytes_in; bytes_out += c->bytes_out;
+    for (b=0; b<HIST_BUCKETS; b++) all.buckets[b] += c->latency.buckets[b];
+    all.count += c->latency.count; all.sum += c->latency.sum;
+    if (c->latency.max > all.max) all.max = c->latency.max;
+  }
+  printf("%s, %d clients, %s for %.1f s\n", proto_names[proto], num_clients,
+         rate>0 ? "open loop" : "closed loop", secs);
+  if (rate>0) printf("  target rate  %.2f req/s\n", rate);
+  printf("  requests     %ld sent, %ld ok, %ld errors, %ld timeouts (error rate %.2f%%)\n",
+         sent, ok, errors, timeouts, sent ? 100.0*(errors+timeouts)/sent : 0.0);
+  printf("  goodput      %.2f req/s, %.2f MB/s of frames in, %.3f MB/s of responses\n",
+         ok/secs, bytes_in/secs/1e6, bytes_out/secs/1e6);
+  if (all.count) {
+    printf("  latency (ms) mean %.2f, p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+           all.sum/1000.0/all.count, hist_percentile(&all, 50)/1000.0, hist_percentile(&all, 90)/1000.0,
+           hist_percentile(&all, 99)/1000.0, hist_percentile(&all, 99.9)/1000.0, all.max/1000.0);
+  }
+}
+
+int main(int argc, char **argv) {
+  int opt, i;
+  while ((opt = getopt(argc, argv, "a:p:P:c:r:d:t:f:R:y:w:vh")) != -1) {
+    switch (opt) {
+      case 'a': addr = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'P':
+        for (proto=0; proto<4 && strcmp(optarg, proto_names[proto]); proto++) ;
+        if (proto==4) {
+          ERR("Unknown protocol %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'c': num_clients = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 't': timeout = atoi(optarg); break;
+      case 'f': out_format = atoi(optarg); break;
+      case 'R': rotation = atoi(optarg); break;
+      case 'y':
+        if (sscanf(optarg, "%dx%d", &yuv_w, &yuv_h)!=2 || yuv_w<=0 || yuv_h<=0) {
+          ERR("Bad NV21 frame size %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'w': window = atoi(optarg); break;
+      case 'v': verbose++; break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return opt=='h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc || num_clients<1 || duration<=0 || timeout<1 || window<1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (window>1 && (rate>0 || (proto!=P_KEEPALIVE && proto!=P_BINARY))) {
+    ERR("-w needs a keepalive or binary connection, closed loop\n");
+    return 1;
+  }
+  if (load_frames(argv[optind])<0) return 1;
+  INFO("Loaded %d frames\n", num_frames);
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  if (inet_pton(AF_INET, addr, &server.sin_addr)!=1) {
+    ERR("Bad server address %s\n", addr);
+    return 1;
+  }
+
+  Client *clients = calloc(num_clients, sizeof(Client));
+  start_time = now_us();
+  end_time = start_time + duration*1e6;
+  for (i=0; i<num_clients; i++) {
+    clients[i].id = i;
+    if (pthread_create(&clients[i].thread, NULL, client_thread, &clients[i])) {
+      ERR("Failed to create client thread %d\n", i);
+      return 1;
+    }
+  }
+  if (verbose) {
+    long last_ok=0;
+    while (now_us() < end_time) {
+      sleep(1);
+      long ok=0, errors=0;
+      for (i=0; i<num_clients; i++) { ok += clients[i].ok; errors += clients[i].errors+clients[i].timeouts; }
+      printf("%.0f s: %ld req/s, %ld errors\n", (now_us()-start_time)/1e6, ok-last_ok, errors);
+      last_ok = ok;
+    }
+  }
+  for (i=0; i<num_clients; i++) pthread_join(clients[i].thread, NULL);
+  report(clients, (now_us()-start_time)/1e6);
+  return 0;
+}
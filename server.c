@@ -8,6 +8,41 @@
 // Allows raw YUV image input now (not just JPEG).  DL 20/9/18
 // Timing info added to json.  DL 23/9/18 
 // Changed to use a single TCP connection for a client to send multipler images, to avoid syn-synack overhead.  A hack just now, and means server can currently only accept one user at a time.  DL 3/5/19
+// Requests now queue for a pool of inference workers (-t) instead of being rejected when the GPU is busy.
+// TCP connections are now served by a few epoll I/O threads (-i) rather than a thread per connection.
+// New HTTP parser, works in place on receive buffer.  Supports keep-alive, pipelining and chunked POST bodies.
+// POST data now goes into recycled buffers sized to fit, so images can be bigger than 1MB.
+// UDP rewritten: packets are read in batches and copied straight into place in the image buffer, and several clients can send at once.
+// Workers can batch requests that arrive close together into one pass through the network (-b, -l).  Stats at GET /stats.
+// Queue is now bounded (-Q) and requests can have a deadline (-D or X-Deadline-Ms header), they're dropped with a 503 if
+// not started in time.  A newer frame from a client replaces its older one still in the queue.
+// Processing split into stages (decode, inference, NMS+JSON), each with its own threads (-c, -t, -o), so the next image
+// is decoding while the current one is in the network.
+// Binary protocol on the TCP port as an alternative to HTTP, with request ids so responses can come back out of order.
+// Responses written in one pass into pooled buffers and sent with the HTTP header by writev.  New out_format 3
+// (/api/edge_app3) gives detections as packed binary records rather than JSON.
+// Timings now wall-clock rather than CPU time, with latency histograms for each step served by GET /metrics.
+// A frame that looks the same as the last one its client sent can reuse its detections instead of going through the network (-S).
+// Tracking mode (track=K): the network only sees every Kth frame of a client, boxes are tracked across the frames in between.
+// Several models can be served at once (-M), picked by URL path and sharing the workers.  They're loaded when first
+// used and the least recently used unloaded to stay within a memory budget (-B).
+// Models can be reloaded from their files without a restart, by SIGHUP or POST /reload.
+// A model can have several input sizes ready to run (-d 608,416,320), a client picks one with the d= query parameter.
+// Prefork mode (-P N): N processes share the port with SO_REUSEPORT, each pinned to its share of the cores, and
+// share one read-only copy of the weights.  CPU only, as CUDA state doesn't survive fork().  A reload is done by the
+// master, which then restarts the processes in turn.
+// Cascade (classify=<model>): each box a detector finds is cropped from the image and classified by a second model,
+// all the crops going through it in batches (up to -b), and the class it gives added to the box.
+// Decoded images are rotated, letterboxed and converted to floats in one pass straight into the network input, a row
+// at a time as libjpeg decodes them.
+// Raw frames can be NV21, NV12, I420 or YUYV (isyuv=<format>), converted to RGB and scaled down in the same pass
+// with SSE2/AVX2 (box filtered when shrinking by 2 or more, otherwise bilinear).
+// Each decode thread reuses one libjpeg decompressor, and a corrupt JPEG is dropped rather than exiting the server.
+// crop=x,y,w,h only decodes (and detects in) that part of a JPEG, the rest is skipped by libjpeg.
+// Without libjpeg, images decoded by stb are box filtered down to the network size as they're letterboxed rather than
+// resized bilinearly, much faster.
+// darknet resize_image/letterbox_image are a separable resampler (bilinear or area) writing straight into the output,
+// so cascade boxes are letterboxed from the image into the batch input without copies.
 
 #define VERSION "1.7"
 
@@ -15,23 +50,48 @@
 #define DEFAULT_MODEL_WEIGHTS "darknet/yolov3.weights"
 #define DEFAULT_MODEL_NAMES "darknet/data/coco.names"
 #define DEFAULT_DIM 608 // default input size to network 608x608
+#define STR_(x) #x
+#define STR(x) STR_(x)
+#define MAX_MODELS 32 // max models in a -M config file
+#define MAX_SIZES 8 // max input sizes per model
+#define CLASSIFY_TOP 5 // classes reported for an image by a classifier model
 #define DEFAULT_PORT 8000
-#define MAXLEN 1024000 // 1MB, max POST image size
+#define DEFAULT_WORKERS 1 // number of inference worker threads
+#define DEFAULT_IO_THREADS 2 // number of threads handling TCP connections
+#define DEFAULT_BATCH 1 // max images per pass through network
+#define MAX_BATCH 64
+#define DEFAULT_QUEUE 64 // max requests waiting for a worker
+#define DEFAULT_DECODERS 2 // number of threads decoding images
+#define DEFAULT_POSTERS 1 // number of threads doing NMS and building responses
+#define MAX_EVENTS 64 // max epoll events handled per wakeup
+#define MAX_PIPELINE 8 // max requests per TCP connection being processed or waiting to be sent
+#define MAXLEN (32*1024*1024) // 32MB, max POST image size
 #define BUFFER_SIZE 4096 // max line size of HTTP request
 #define RECV_TIMEOUT 20000 // timeout in us (used to abort connection on packet loss)
 
+#define _GNU_SOURCE // for memmem, accept4
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <libgen.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
+#if defined(__SSE2__)
+  #include <immintrin.h>
+#endif
 
 #include "darknet/include/darknet.h"
 
 #ifdef LIBJPEG // faster option using tweaked libjpeg-turbo
   #include <jpeglib.h>
+  #include <setjmp.h>
 #else
   #define STB_IMAGE_IMPLEMENTATION
+  #if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define STBI_NEON // stb only uses NEON if asked (it does SSE2 itself)
+  #endif
   #ifdef __ANDROID__  // ndk-build compiles statically against darknet
   #else
     #include "darknet/src/stb_image.h"
@@ -44,39 +104,287 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <poll.h>
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 
 // global vars, easier to use within thread
-int active=0;  // indicates whether GPU is busy or not
-pthread_mutex_t active_mutex = PTHREAD_MUTEX_INITIALIZER;
-network *net;           // neural net
-char **names;           // class labels
 int verbose=0;          // debugging level
 int save_to_file=0;     // indicates whether received images are to be dumped out to file
 int count=0;            // counts number of images processed
-
-// struct for passing parameters to thread
-typedef struct Params {
-   int session_fd;  // socket to receive data on (will be pipe when a UDP connection)  
-   int send_fd; // socket to send response on
-   struct sockaddr_in si_active; // client address for connection, NULL for TCP
-   int slen;  // set to 0 fot TCP
-   void* ptr; // for debugging
-} Params;
-
-// struct for reassembly buffer
-#define REASSEMBLY_SIZE 1024
-typedef struct reassembly_info {
-  int nxt_pkt_index; // index of next in-order packet
-  int highest_pkt_index; 
-  char* reassembly_buf[REASSEMBLY_SIZE]; // out of order packets
-  int reassembly_buf_len[REASSEMBLY_SIZE]; // size of each packet
-} reassembly_info;
-void dump_reassembly_state(reassembly_info *r_info);
+int num_workers=DEFAULT_WORKERS; // number of inference workers
+int num_decoders=DEFAULT_DECODERS; // number of decode threads
+int num_posters=DEFAULT_POSTERS; // number of NMS/response threads
+int num_io_threads=DEFAULT_IO_THREADS; // number of TCP I/O threads
+int udp_fd=-1;          // UDP socket, responses to UDP requests are sent on this
+int batch_size=DEFAULT_BATCH; // max images a worker runs through the network at once
+int batch_window=0;     // how long (us) a worker waits for a batch to fill up
+int default_deadline=0; // ms a request can wait for a worker before being dropped, 0 for no limit
+int max_queue=DEFAULT_QUEUE; // max requests waiting for a worker
+float repeat_threshold=0; // max difference between frames for them to count as the same, 0 to always process frames
+size_t memory_budget=0; // bytes loaded models can use, 0 for no limit
+int num_procs=1;        // number of server processes (prefork mode if more than 1)
+int proc_index=0;       // which of them this is
+
+struct Connection;
+
+enum { EP_DETECT, EP_DUMMY, EP_STATS, EP_METRICS, EP_RELOAD }; // what a request is asking for
+
+#define THUMB_SIZE 16 // frames are compared on a THUMB_SIZE x THUMB_SIZE luma thumbnail
+
+// a loaded model's networks.  reloading the model gives it a new set, and the old one is freed once the last
+// worker using it is done
+typedef struct ModelNets {
+  struct Model *model;
+  network *net; // holds the weights
+  network **nets; // each worker's instance for each size, nets[size*num_workers+worker] (own activations, weights
+                  // shared), NULL until the worker first uses it
+  size_t bytes; // estimated memory use
+  void *map; // weights in shared read-only memory (prefork mode), NULL if they're malloc'd
+  size_t map_size;
+  int users; // workers using them
+  struct ModelNets *next; // in list of those retired but still in use
+} ModelNets;
+
+// a model the server can run.  requests pick one by URL path, /<name>/api/edge_app2, or get the first.  the weights
+// are loaded when a request first needs them, and models nobody is using can be unloaded again to make room
+typedef struct Model {
+  char *name;
+  char *cfgfile, *weightfile, *namesfile;
+  int w[MAX_SIZES], h[MAX_SIZES]; // network input sizes it's ready to run at, the first is the default
+  int num_sizes;
+  int detector; // has yolo/region/detection layers, otherwise it's a classifier and gives the top classes for the image
+  int max_batch; // region/detection layers can't be batched
+  char **names; // class labels
+  ModelNets *loaded; // NULL if not loaded
+  int loading;
+  int reload; // wanted
+  long last_used; // us
+  long requests, loads, evictions, reloads;
+} Model;
+
+Model models[MAX_MODELS];
+int num_models=0;
+size_t memory_used=0; // by loaded models
+ModelNets *retired=NULL; // networks of reloaded models still being used by workers
+pthread_mutex_t models_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t models_cond = PTHREAD_COND_INITIALIZER; // a model finished loading
+
+// a detection that made it through NMS and the threshold, in original image coordinates
+typedef struct Box {
+  int cls;
+  float prob;
+  int x, y, w, h; // centre and size
+  int sub; // class the cascade classifier gave the box, -1 if none
+  float sub_prob;
+} Box;
+
+typedef struct Roi { // region of an image to decode
+  int x, y, w, h; // w 0 for all of it
+  int img_w, img_h; // size of whole image, filled in by decoder
+} Roi;
+
+// a request that has been read off the network and is waiting for (or undergoing) inference
+typedef struct Request {
+  int endpoint;
+  char *post_data; // image to be processed
+  int len;
+  int out_format, rotation, isYUV, w, h; // isYUV is the YUV_ format of a raw frame, 0 for JPEG
+  int keep_alive; // keep TCP connection open after response
+  int status; // HTTP status of response
+  long starttime; // when we started reading the request (us, see now_us())
+  int deadline_ms; // from X-Deadline-Ms header, 0 to use default_deadline
+  long deadline; // time (us, see now_us()) by which a worker must pick up request, 0 if no limit
+  uint64_t client; // who sent it (X-Client-Id header, TCP connection or UDP address)
+  Model *model; // NULL for the default
+  int d; // network input size asked for (d= query parameter), 0 for the model's default
+  int size; // index of model's input size that's closest
+  Model *cascade; // classifier to run on each box found (classify= query parameter), NULL for none
+  int keep_all; // a newer request from the same client mustn't replace this one (binary protocol)
+  int track_k; // tracking mode: run network on every track_k'th frame and track boxes in between, 0 for off
+  int track_diff; // tracking mode: max mean luma difference for a box to count as found in a new frame
+  Roi roi; // only this part of the image is run through the network (crop=x,y,w,h query parameter, JPEG only)
+  // filled in as the request goes through the pipeline
+  image im; // decoded image, in network input format
+  float scale; // scaling applied to image
+  int pad_w, pad_h; // letterbox padding
+  int off_x, off_y; // where the decoded region is in the rotated image, added to box coordinates
+  detection *dets;
+  int nboxes;
+  unsigned char thumb[THUMB_SIZE*THUMB_SIZE]; // for spotting repeated frames
+  int cached; // boxes are already known (frame cache, tracker or classifier), no need to turn detections into boxes
+  Box *boxes; // detections kept for the frame cache and tracker
+  int num_boxes;
+  unsigned char *luma; // tracking mode: luma of image in network input format
+  long t_received, t_decode, t_rot, t_ready, t_yolo, t_post, t_json, t_done; // when each step started (us)
+  uint32_t bin_id; // request id, for binary protocol
+  int sent; // response has been sent (binary responses can go before those of earlier requests)
+  char *response; // filled in by worker (a pool buffer), NULL on failure
+  int response_len;
+  struct Connection *conn; // TCP connection the request arrived on, NULL for UDP
+  struct sockaddr_in udp_addr; // UDP client to send response to
+  int done; // set by worker once response is ready
+  struct Request *next;
+} Request;
+
+// state of HTTP request parser
+enum { HTTP_REQ_LINE, HTTP_HEADERS, HTTP_BODY, HTTP_CHUNK_SIZE, HTTP_CHUNK_DATA, HTTP_CHUNK_END, HTTP_TRAILERS, HTTP_DONE };
+typedef struct HttpParser {
+  int state;
+  size_t posn; // offset of first unparsed byte in buffer
+  int version; // minor version, i.e. HTTP/1.x
+  int keep_alive;
+  long content_length; // -1 if not given
+  int chunked;
+  long chunk_left; // bytes left in current chunk
+} HttpParser;
+
+// binary protocol.  if the first bytes on a TCP connection are BIN_MAGIC, it's binary rather than HTTP for
+// good.  each request is a BinHeader followed by len bytes of image, and each response a BinResponse followed
+// by the body (the same JSON as for HTTP).  responses are tagged with the request's id and sent as soon as
+// they're ready, which may not be the order the requests came in.  all fields are little-endian
+#define BIN_MAGIC "EDG1"
+#define BIN_RESPONSE_MAGIC "EDR1"
+enum { BIN_JPEG, BIN_NV21, BIN_PING, BIN_NV12, BIN_I420, BIN_YUYV }; // request types
+enum { YUV_NONE, YUV_NV21, YUV_NV12, YUV_I420, YUV_YUYV, // raw frame formats, isyuv= query parameter
+       YUV_RGB, YUV_GREY }; // and decoded images (packed RGB or greyscale), which are only scaled
+const char *yuv_names[] = {"", "nv21", "nv12", "i420", "yuyv"};
+#define BIN_LATEST 1 // flag: a newer frame from this client can replace this one in the queue
+
+typedef struct __attribute__((packed)) BinHeader {
+  char magic[4]; // BIN_MAGIC
+  uint32_t id; // chosen by client, echoed in response
+  uint8_t type; // BIN_JPEG, a raw YUV frame (BIN_NV21 etc.), or BIN_PING (no image, just gets an empty response)
+  uint8_t format; // out_format of response
+  uint8_t flags;
+  uint8_t track; // tracking mode, as track= query parameter (0 for off)
+  int16_t rotation;
+  uint16_t w, h; // image size, needed for YUV
+  uint16_t deadline_ms; // 0 for server default
+  uint32_t len; // size of image that follows
+} BinHeader;
+
+typedef struct __attribute__((packed)) BinResponse {
+  char magic[4]; // BIN_RESPONSE_MAGIC
+  uint32_t id;
+  uint16_t status; // as for HTTP, 200 if ok
+  uint16_t size; // network input size the image was run at, 0 if it wasn't
+  uint32_t len; // size of body that follows
+} BinResponse;
+
+// out_format 3 is binary rather than JSON, an array of these (no timings).  little-endian
+#define OUT_BINARY 3
+
+typedef struct __attribute__((packed)) DetectionRecord {
+  uint16_t cls; // index into names
+  uint16_t sub; // 1 + class the cascade classifier gave the box, 0 if none
+  float confidence;
+  int16_t x, y, w, h; // box centre and size, in pixels of the original image
+} DetectionRecord;
+
+// requests wait here until a worker is free.  it holds at most one request per client, since for live
+// video only the latest frame matters
+typedef struct RequestQueue {
+  Request *head, *tail;
+  int depth;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} RequestQueue;
+RequestQueue request_queue = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+// after leaving the request queue, requests go through a pipeline of stages: decode (and rotate and
+// letterbox), inference and finally NMS and building the response.  each stage has its own threads,
+// and stages are linked by bounded lock-free queues so a stage that falls behind holds up the ones before it
+enum { STAGE_DECODE, STAGE_INFER, STAGE_POST, NUM_STAGES };
+char *stage_names[NUM_STAGES] = {"decode", "infer", "post"};
+
+// bounded multi-producer multi-consumer queue (Dmitry Vyukov's design).  each cell has a sequence number
+// saying whether it's ready to be written or read on the current lap, so producers and consumers only
+// contend on a CAS of their own position.  a pair of semaphores count items and free slots, so threads can
+// sleep when there's nothing to do
+typedef struct QueueCell {
+  size_t seq;
+  void *data;
+} QueueCell;
+
+typedef struct StageQueue {
+  QueueCell *cells;
+  size_t mask; // size-1, size is a power of 2
+  char pad0[64]; // keep positions on separate cache lines
+  size_t enq_pos;
+  char pad1[64];
+  size_t deq_pos;
+  char pad2[64];
+  sem_t items, slots;
+} StageQueue;
+StageQueue infer_queue, post_queue;
+void stage_queue_init(StageQueue *q, int capacity);
+
+// an inference worker.  each has its own copy of the network activations for every model it has run, weights are
+// shared.  models never run at the same time on a worker, so they all use the same scratch workspace
+typedef struct Worker {
+  int id;
+  Request *batch[MAX_BATCH]; // batch being collected
+  Request *pending; // next request, which is for a different model to the batch
+  ModelNets *using; // networks of model it's running
+  float *input; // network input for whole batch
+  size_t input_size; // floats
+  float *workspace;
+  size_t workspace_size; // bytes
+  pthread_t thread;
+} Worker;
+
+// counters reported by GET /stats
+typedef struct Stats {
+  long batches[MAX_BATCH+1]; // number of passes through the network of each batch size
+  long admitted, replaced, expired, overflowed; // requests into queue, and dropped from it
+  long repeats, misses; // frames answered from the frame cache, and those that weren't
+  long tracked, keyframes; // tracking mode frames handled by tracker and by network
+  long crops; // boxes classified by a cascade
+  long busy[NUM_STAGES]; // time (us) threads of each stage have spent working
+  long start_time; // when server started (us)
+} Stats;
+Stats stats;
+
+// latency of each step of handling a request, for GET /metrics
+enum { T_RECEIVE, T_QUEUE, T_DECODE, T_ROTATE, T_INFER, T_NMS, T_SERIALIZE, T_SEND, T_TOTAL, NUM_TIMINGS };
+const char *timing_names[NUM_TIMINGS] = {"receive", "queue", "decode", "rotate", "inference", "nms", "serialize", "send", "total"};
+
+// histogram buckets are log-linear: HIST_SUB of them for each power of two, so a bucket is within
+// 1/HIST_SUB of its values (as HdrHistogram does).  updated with atomic adds, so no locking
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_BUCKETS (38*HIST_SUB) // up to 2^41us, about 25 days
+
+typedef struct Histogram {
+  long count, sum, max; // of values recorded (us)
+  long buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct Metrics {
+  Histogram timings[NUM_TIMINGS];
+  long completed, failed; // responses sent to detection requests
+  long bytes_in, bytes_out; // image data received and responses sent
+} Metrics;
+Metrics metrics;
+
+Worker *workers;
+void* worker_thread(void* param);
+void* decode_thread(void* param);
+void* post_thread(void* param);
 
 #define DEBUG_JSON(args ...) if (verbose&16) printf(args)
 #define DEBUG_UDP(args ...) if (verbose&8) printf(args)
@@ -86,9 +394,16 @@ void dump_reassembly_state(reassembly_info *r_info);
 #define ERR(args ...) do{fprintf(stderr,"ERROR: "); fprintf(stdout, args);}while(0)
 #define WARN(args ...) do{fprintf(stderr,"WARNING: "); fprintf(stdout, args);}while(0)
 #define INFO(args ...) if (verbose) fprintf(stdout, args)
-#define TICK(X) clock_t (X) = clock()
-#define TOCK(X,Y)  (double)((X) - (Y)) / CLOCKS_PER_SEC
-#define NOW clock()
+#define TICK(X) long (X) = now_us()
+#define TOCK(X,Y)  (double)((X) - (Y)) / 1000000
+#define NOW now_us()
+
+long now_us() {
+  // monotonic time in us
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000L + t.tv_nsec/1000;
+}
 
 void usage(char *progname) {
   char* usage_str =
@@ -96,242 +411,936 @@ void usage(char *progname) {
   "          -m    sets file containing model config\n"
   "          -w    sets file containing model weights\n"
   "          -n    sets file containing class names\n"
-  "          -d    sets input size of network\n"
+  "          -d    sets input size of network, or a list of them (e.g. 608,416,320) for clients to choose from with\n"
+  "                the d= query parameter, the first is the default\n"
+  "          -M    sets file listing models to serve, one per line: name cfg weights names [sizes]\n"
+  "                (first is the default, others are reached by URL path /<name>/api/...).  overrides -m, -w, -n, -d\n"
+  "          -B    sets memory (MB) loaded models can use before the least recently used are unloaded (default 0, no limit)\n"
+  "          -P    sets number of server processes sharing the port, each with its share of the CPUs, CPU only (default 1)\n"
   "          -p    sets port for server to listen on\n"
+  "          -t    sets number of inference worker threads (default 1)\n"
+  "          -c    sets number of image decoding threads (default 2)\n"
+  "          -o    sets number of threads doing NMS and building responses (default 1)\n"
+  "          -i    sets number of TCP I/O threads (default 2)\n"
+  "          -b    sets max number of images per pass through network (default 1)\n"
+  "          -l    sets time (ms) a worker waits for more images to batch up (default 0)\n"
+  "          -D    sets time (ms) a request can wait for a worker before it's dropped (default 0, no limit)\n"
+  "          -Q    sets max number of requests waiting for a worker (default 64)\n"
+  "          -S    sets how alike (mean luma difference, 0-255) a frame must be to its client's last one to reuse its\n"
+  "                detections rather than run the network again (default 0, off)\n"
   "          -v    print extra diagnostic output\n"
   "          -s    saves each received image to a file (named img_<count>.jpg)\n"
   "          -h    prints this message\n";
   printf(usage_str, progname, VERSION);
 }
 
-int read_line(int fd, char* inbuf, size_t *inbuf_used, char* line) {
-  //read from socket until hit next newline. fine for both TCP and UDP sockets.
-  int i=0;
-  size_t read_posn=0;
-  while (i < BUFFER_SIZE) {
-    if (read_posn == *inbuf_used) {
-      // read from socket
-      // TO DO: check that packet is from expected source IP/port (might be interleaved with a new request for example)
-      ssize_t rv = recv(fd, (void*)&inbuf[*inbuf_used], BUFFER_SIZE - *inbuf_used, 0);
-      if (rv == 0) {
-        WARN("HTTP connection closed.\n");
+// Pool of recycled buffers for POST data and responses.  Buffers come in power-of-two size classes from
+// 1<<POOL_MIN_SHIFT up, each class keeping a free list of slabs released by earlier requests, so once
+// the server has warmed up it does no mallocs for image data.
+
+#define POOL_MIN_SHIFT 12 // smallest slab is 4KB, enough for most responses
+#define POOL_CLASSES 14 // largest is 32MB
+#define POOL_MAX_FREE 64 // max slabs kept on each free list
+
+typedef struct PoolSlab {
+  struct PoolSlab *next;
+  size_t size; // usable size of slab
+  int cls; // size class, -1 if too big to recycle
+  int pad;
+} PoolSlab;
+
+typedef struct BufferPool {
+  PoolSlab *free[POOL_CLASSES];
+  int nfree[POOL_CLASSES];
+  long mallocs, reuses; // for monitoring
+  pthread_mutex_t mutex;
+} BufferPool;
+BufferPool pool = {{NULL}, {0}, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+char* pool_get(size_t size) {
+  // get a buffer of at least size bytes, NULL if it's more than any request could need
+  int cls=0;
+  if (size > MAXLEN) {
+    ERR("Refusing to allocate %zu byte buffer\n", size);
+    return NULL;
+  }
+  while (cls<POOL_CLASSES && ((size_t)1<<(POOL_MIN_SHIFT+cls)) < size) cls++;
+  PoolSlab *slab = NULL;
+  pthread_mutex_lock(&pool.mutex);
+  if (cls<POOL_CLASSES && pool.free[cls]) {
+    slab = pool.free[cls];
+    pool.free[cls] = slab->next;
+    pool.nfree[cls]--;
+    pool.reuses++;
+  } else {
+    pool.mallocs++;
+  }
+  pthread_mutex_unlock(&pool.mutex);
+  if (slab==NULL) {
+    size_t slab_size = cls<POOL_CLASSES ? (size_t)1<<(POOL_MIN_SHIFT+cls) : size;
+    slab = malloc(sizeof(PoolSlab)+slab_size);
+    if (slab==NULL) {
+      ERR("Out of memory allocating %zu byte buffer\n", slab_size);
+      return NULL;
+    }
+    slab->size = slab_size;
+    slab->cls = cls<POOL_CLASSES ? cls : -1;
+  }
+  return (char*)(slab+1);
+}
+
+void pool_put(char *buf) {
+  // give buffer back to pool
+  if (buf==NULL) return;
+  PoolSlab *slab = ((PoolSlab*)buf)-1;
+  if (slab->cls>=0) {
+    pthread_mutex_lock(&pool.mutex);
+    if (pool.nfree[slab->cls] < POOL_MAX_FREE) {
+      slab->next = pool.free[slab->cls];
+      pool.free[slab->cls] = slab;
+      pool.nfree[slab->cls]++;
+      slab = NULL;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+  }
+  free(slab);
+}
+
+size_t pool_size(char *buf) {
+  // usable size of buffer
+  return buf ? (((PoolSlab*)buf)-1)->size : 0;
+}
+
+char* pool_grow(char *buf, size_t used, size_t size) {
+  // swap buf for a buffer of at least size bytes, keeping the first used bytes
+  if (size <= pool_size(buf)) return buf;
+  char *bigger = pool_get(size);
+  if (bigger && used) memcpy(bigger, buf, used);
+  pool_put(buf);
+  return bigger;
+}
+
+// HTTP/1.1 request parsing.  The parser works in place on the receive buffer (nothing is copied or
+// written to), a line at a time, and can be called again as more data arrives: p->posn records how much
+// of the buffer has been consumed so far.
+
+int span_eq(const char *s, const char *end, const char *lit) {
+  // exact match of [s,end) against literal lit
+  size_t n = strlen(lit);
+  return end-s == n && memcmp(s, lit, n)==0;
+}
+
+int lower_eq(const char *s, const char *end, const char *lit) {
+  // case-insensitive match of [s,end) against lower case literal lit
+  size_t n = strlen(lit);
+  if (end-s != n) return 0;
+  while (n--) {
+    char ch = *s++;
+    if (ch>='A' && ch<='Z') ch += 'a'-'A';
+    if (ch != *lit++) return 0;
+  }
+  return 1;
+}
+
+long parse_long(const char *s, const char *end, int base) {
+  // parse non-negative number in [s,end), returns -1 if not a number
+  long val=0; int digits=0;
+  while (s<end && *s==' ') s++;
+  if (s<end && *s=='-' && base==10) { // allow negative rotations
+    val = parse_long(s+1, end, base);
+    return val<0 ? -1 : -val;
+  }
+  for (; s<end; s++, digits++) {
+    int d;
+    if (*s>='0' && *s<='9') d = *s-'0';
+    else if (base==16 && *s>='a' && *s<='f') d = *s-'a'+10;
+    else if (base==16 && *s>='A' && *s<='F') d = *s-'A'+10;
+    else break;
+    if (val > (LONG_MAX-d)/base) return -1; // overflow
+    val = val*base + d;
+  }
+  return digits ? val : -1;
+}
+
+void http_init(HttpParser *p) {
+  memset(p, 0, sizeof(HttpParser));
+  p->state = HTTP_REQ_LINE;
+  p->content_length = -1;
+}
+
+Model* find_model(const char *s, const char *end) {
+  // model called s (up to end), NULL if none
+  int i;
+  for (i=0; i<num_models; i++) {
+    if (span_eq(s, end, models[i].name)) return &models[i];
+  }
+  return NULL;
+}
+
+int parse_query(const char *q, const char *end, Request *r) {
+  // pick out the parameters we know about from name=value&name=value...  returns -1 if one is bad
+  int i;
+  while (q < end) {
+    const char *amp = memchr(q, '&', end-q);
+    if (!amp) amp = end;
+    const char *eq = memchr(q, '=', amp-q);
+    if (eq && lower_eq(q, eq, "classify")) {
+      r->cascade = find_model(eq+1, amp);
+      if (!r->cascade || r->cascade->detector) {
+        ERR("No classifier called %.*s\n", (int)(amp-eq-1), eq+1);
         return -1;
       }
-      if (rv < 0) {
-        if (errno == EAGAIN) { 
-           WARN("HTTP connection timeout\n"); 
-        } else {
-           ERR("HTTP connection error: %s\n",strerror(errno));
-        }
+    } else if (eq && lower_eq(q, eq, "crop")) { // x,y,w,h
+      const char *v = eq+1;
+      long xywh[4];
+      for (i=0; i<4; i++) {
+        const char *comma = memchr(v, ',', amp-v);
+        if (!comma) comma = amp;
+        xywh[i] = parse_long(v, comma, 10);
+        v = comma+1;
+        if (xywh[i]<0 || xywh[i]>65535 || (i<3 && comma==amp)) break;
+      }
+      if (i<4 || xywh[2]==0 || xywh[3]==0) {
+        ERR("Bad crop %.*s\n", (int)(amp-eq-1), eq+1);
         return -1;
       }
-      *inbuf_used += rv;
+      r->roi.x = xywh[0]; r->roi.y = xywh[1]; r->roi.w = xywh[2]; r->roi.h = xywh[3];
+    } else if (eq) {
+      long val = parse_long(eq+1, amp, 10);
+      if (lower_eq(q, eq, "r")) r->rotation = val;
+      else if (lower_eq(q, eq, "w")) r->w = val;
+      else if (lower_eq(q, eq, "h")) r->h = val;
+      else if (lower_eq(q, eq, "isyuv")) { // 1 (NV21) or a YUV_ format, by number or name
+        for (i=YUV_NV21; i<=YUV_YUYV; i++) {
+          if (lower_eq(eq+1, amp, yuv_names[i])) val = i;
+        }
+        r->isYUV = val;
+      }
+      else if (lower_eq(q, eq, "track")) r->track_k = val;
+      else if (lower_eq(q, eq, "trackdiff")) r->track_diff = val;
+      else if (lower_eq(q, eq, "d")) r->d = val;
     }
-    line[i++] = inbuf[read_posn++]; // advance read position within buffer
-    if (line[i-1]=='\n') break; // have hit a newline, stop
+    q = amp+1;
   }
-  if (i==BUFFER_SIZE) {
-    ERR("HTTP request input line larger than %d.\n",BUFFER_SIZE);
-    // could send "413 Entity Too Large" response back to client
+  DEBUG_HTTP("rotate: %d yuv: %d w: %d h: %d\n", r->rotation, r->isYUV, r->w, r->h);
+  return 0;
+}
+
+int http_request_line(HttpParser *p, const char *s, const char *end, Request *r) {
+  // parse "POST /api/edge_app2?r=90 HTTP/1.1", which gives the API being called and its parameters
+  const char *sp1 = memchr(s, ' ', end-s);
+  if (!sp1) return -1;
+  const char *target = sp1+1;
+  const char *sp2 = memchr(target, ' ', end-target);
+  if (!sp2 || end-sp2 < 9 || memcmp(sp2+1, "HTTP/1.", 7)) return -1;
+  p->version = sp2[8]-'0';
+  p->keep_alive = (p->version >= 1); // HTTP/1.1 defaults to persistent connections, 1.0 doesn't
+  const char *q = memchr(target, '?', sp2-target);
+  const char *path_end = q ? q : sp2;
+  DEBUG_HTTP("req: %.*s\n", (int)(path_end-target), target);
+  if (sp1-s == 3 && !memcmp(s, "GET", 3) && span_eq(target, path_end, "/stats")) {
+    r->endpoint = EP_STATS;
+    return 0;
+  }
+  if (sp1-s == 3 && !memcmp(s, "GET", 3) && span_eq(target, path_end, "/metrics")) {
+    r->endpoint = EP_METRICS;
+    return 0;
+  }
+  if (sp1-s != 4 || memcmp(s, "POST", 4)) {
+    ERR("Invalid request method: %.*s\n", (int)(sp1-s), s);
     return -1;
   }
-  line[i]='\0'; // terminate line as string, makes for easier printing when debugging
-  // shift buffer contents so next line starts at posn 0
-  memmove(inbuf,inbuf+read_posn,*inbuf_used-read_posn);
-  *inbuf_used -= read_posn;
-
-  return i;
-}
-
-int get_post_data(int fd, char* post_data, int *len, int *out_format, int *rotation, 
-                  int *isYUV, int *w, int *h) {
-  // extract POST data (the image to be processed) from http request
-  size_t inbuf_used = 0;
-  char inbuf[BUFFER_SIZE], line[BUFFER_SIZE];
-  int lines_read=0, content_length=0, res;
-  // parse HTTP request and headers
-  while ( (res=read_line(fd, inbuf, &inbuf_used, line))>0) {
-    DEBUG_HTTP("%s",line);
-    lines_read++;
-    if (lines_read==1) {
-       // first line is HTTP request
-       char req[BUFFER_SIZE]; memset(req,0,BUFFER_SIZE);
-       sscanf(line,"POST %s HTTP/", req);
-       DEBUG_HTTP("req: %s\n",req);
-       // separate request from parameters, if any
-       size_t posn = strcspn(req, "?");
-       req[posn]='\0';
-       char* paras = &req[posn+1];
-       if (strcmp("/api/edge_app",req)==0) {
-          *out_format=0;
-       } else if (strcmp("/dummy",req)==0) {
-	  return -1; // dummy req, bail
-       } else if (strcmp("/detect",req)==0) {
-          *out_format=1;
-       } else if (strcmp("/api/edge_app2",req)==0) { // NG format!
-          *out_format=2;
-          if (strlen(paras)>0) {
-            char* lasts;
-            char* para=strtok_r(paras,"& ",&lasts);
-            //printf("para=%s\n",para);
-            while (para!=NULL) {
-               char* name = strtok(para,"=");
-               char* val = strtok(NULL," ");
-               //printf("%s %s\n",name,val);
-               para=strtok_r(NULL,"& ",&lasts);
-               //printf("para=%s\n",para);
-               if (strcmp(name, "r")==0) { *rotation=atoi(val); continue;}
-               if (strcmp(name, "w")==0) {*w=atoi(val); continue;}
-               if (strcmp(name, "h")==0) {*h=atoi(val); continue;}
-               if (strcmp(name, "isYUV")==0) {*isYUV=atoi(val); continue;}
-            }
-            DEBUG_HTTP("rotate: %d\n", *rotation);
-            DEBUG_HTTP("yuv: %d\n", *isYUV);
-            DEBUG_HTTP("w: %d\n", *w);
-            DEBUG_HTTP("h: %d\n", *h);
-          }
-       } else {
-         ERR("Invalid request: %s",line);
-         return -1;
-       }
-       continue; 
-    } 
-    // parse HTTP headers to get content-length (length of POST body)
-    if(line[0]=='\r' && line[1] == '\n') {
-       // an empty line, have reached end of request and headers
-       break;
-    }
-    size_t posn = strcspn(line, ":");  // extract the header name
-    char *header_name = line; header_name[posn]='\0';
-    posn++; while (line[posn] == ' ') {posn++;}
-    size_t value_len = strcspn(line+posn, "\r\n"); // header value
-    char *header_value = line+posn; header_value[value_len]='\0';
-    DEBUG_HTTP("header: %s %s\n", header_name, header_value);
-    if (strcmp("Content-Length",header_name)==0) {
-      content_length = atoi(header_value);
-      DEBUG_HTTP("content-length=%d\n",content_length);
-    }
-  }
-  if (res<0) {
+  r->endpoint = EP_DETECT;
+  const char *slash = path_end-target > 1 ? memchr(target+1, '/', path_end-target-1) : NULL;
+  if (slash && (r->model = find_model(target+1, slash))) target = slash; // /<model>/api/...
+  if (span_eq(target, path_end, "/reload")) {
+     r->endpoint = EP_RELOAD; // reload r->model, or all models
+  } else if (span_eq(target, path_end, "/api/edge_app")) {
+     r->out_format=0;
+  } else if (span_eq(target, path_end, "/dummy")) {
+     r->endpoint = EP_DUMMY; // connection warm-up, no image processing
+  } else if (span_eq(target, path_end, "/detect")) {
+     r->out_format=1;
+  } else if (span_eq(target, path_end, "/api/edge_app2")) { // NG format!
+     r->out_format=2;
+     if (q && parse_query(q+1, sp2, r)<0) return -1;
+  } else if (span_eq(target, path_end, "/api/edge_app3")) { // binary detections
+     r->out_format=OUT_BINARY;
+     if (q && parse_query(q+1, sp2, r)<0) return -1;
+  } else {
+    ERR("Invalid request: %.*s\n", (int)(end-s), s);
+    return -1;
+  }
+  return 0;
+}
+
+int http_header(HttpParser *p, const char *s, const char *end, Request *r) {
+  // parse one "Name: value" header line, we only care about a few of them
+  const char *colon = memchr(s, ':', end-s);
+  if (!colon) return -1;
+  const char *val = colon+1;
+  while (val<end && (*val==' ' || *val=='\t')) val++;
+  while (end>val && (end[-1]==' ' || end[-1]=='\t')) end--;
+  DEBUG_HTTP("header: %.*s: %.*s\n", (int)(colon-s), s, (int)(end-val), val);
+  switch (colon-s) {
+    case 10:
+      if (lower_eq(s, colon, "connection")) {
+        if (lower_eq(val, end, "close")) p->keep_alive=0;
+        else if (lower_eq(val, end, "keep-alive")) p->keep_alive=1;
+      }
+      break;
+    case 11:
+      if (lower_eq(s, colon, "x-client-id")) {
+        // FNV-1a hash, top bit set so it can't clash with the default ids
+        uint64_t h=14695981039346656037ULL;
+        for (; val<end; val++) h = (h^(unsigned char)*val)*1099511628211ULL;
+        r->client = h | (1ULL<<63);
+      }
+      break;
+    case 13:
+      if (lower_eq(s, colon, "x-deadline-ms")) {
+        r->deadline_ms = parse_long(val, end, 10);
+        if (r->deadline_ms<0) return -1;
+      }
+      break;
+    case 14:
+      if (lower_eq(s, colon, "content-length")) {
+        p->content_length = parse_long(val, end, 10);
+        if (p->content_length<0) return -1;
+      }
+      break;
+    case 17:
+      if (lower_eq(s, colon, "transfer-encoding")) {
+        if (end-val>=7 && lower_eq(end-7, end, "chunked")) p->chunked=1;
+      }
+      break;
+  }
+  return 0;
+}
+
+int http_parse_head(HttpParser *p, const char *buf, size_t len, Request *r) {
+  // parse request line and headers.  returns 1 once they are complete (p->posn is then the start of
+  // the body), 0 if more data is needed and -1 if the request is bad
+  while (p->state==HTTP_REQ_LINE || p->state==HTTP_HEADERS) {
+    const char *s = buf+p->posn;
+    const char *nl = memchr(s, '\n', len-p->posn);
+    if (!nl) return 0;
+    const char *end = (nl>s && nl[-1]=='\r') ? nl-1 : nl;
+    p->posn = nl+1-buf;
+    if (p->state==HTTP_REQ_LINE) {
+      if (end==s) continue; // ignore blank lines before request
+      if (http_request_line(p, s, end, r)<0) return -1;
+      p->state = HTTP_HEADERS;
+    } else if (end==s) {
+      // blank line, end of headers
+      if (p->chunked) {
+        p->state = HTTP_CHUNK_SIZE;
+      } else if (p->content_length > 0) {
+        p->state = HTTP_BODY;
+      } else if (r->endpoint == EP_STATS || r->endpoint == EP_METRICS || r->endpoint == EP_RELOAD) {
+        p->state = HTTP_DONE; // no body
+      } else {
+        ERR("HTTP request has no POST data\n");
+        return -1;
+      }
+      return 1;
+    } else if (http_header(p, s, end, r)<0) {
+      ERR("Bad HTTP header: %.*s\n", (int)(end-s), s);
+      return -1;
+    }
+  }
+  return 1;
+}
+
+int bin_parse_head(HttpParser *p, const char *buf, size_t len, Request *r) {
+  // parse binary request header.  same return values as http_parse_head(), and the parser is left in the same
+  // state as for an HTTP request with a Content-Length (or HTTP_DONE for a ping), so the image is read the same way
+  BinHeader h;
+  if (len < sizeof(h)) return 0;
+  memcpy(&h, buf, sizeof(h));
+  if (memcmp(h.magic, BIN_MAGIC, 4)) {
+    ERR("Bad binary request header\n");
     return -1;
   }
-  if (content_length ==0) {
-    ERR("HTTP request has no POST data\n");
+  r->bin_id = h.id;
+  r->endpoint = h.type==BIN_PING ? EP_DUMMY : EP_DETECT;
+  r->isYUV = h.type==BIN_NV21 ? YUV_NV21 : h.type==BIN_NV12 ? YUV_NV12 : h.type==BIN_I420 ? YUV_I420 :
+             h.type==BIN_YUYV ? YUV_YUYV : YUV_NONE;
+  r->out_format = h.format;
+  r->rotation = h.rotation;
+  r->w = h.w; r->h = h.h;
+  r->deadline_ms = h.deadline_ms;
+  // unless client says otherwise, each frame is wanted (a client with several frames in flight
+  // shouldn't have them replacing each other)
+  if (!(h.flags & BIN_LATEST)) r->keep_all = 1;
+  r->track_k = h.track;
+  DEBUG_HTTP("binary request %u: type %d, len %u\n", h.id, h.type, h.len);
+  p->posn = sizeof(h);
+  p->keep_alive = 1;
+  p->content_length = h.len;
+  if (h.type==BIN_PING) {
+    p->state = HTTP_DONE;
+  } else if (h.type>BIN_YUYV || h.len==0) {
+    ERR("Bad binary request, type %d len %u\n", h.type, h.len);
     return -1;
+  } else {
+    p->state = HTTP_BODY;
   }
-  // now read the post data ...
-  // copy over the part already read into buffer
-  int extra = (int) inbuf_used;
-  memcpy(post_data,inbuf,extra);
-  ssize_t bytes=extra;
-  // and now read the rest from socket
-  ssize_t rv=0; 
-  while (bytes < content_length) {
-    rv = recv(fd, (void*)&post_data[bytes], MAXLEN - bytes, 0);
-    if (rv < 0) {
-       if (errno == EAGAIN)
-          INFO("Timeout when reading POST data %d/%d (packet loss ?)\n", bytes, content_length);
-       else 
-          ERR("Problem when reading POST data: %s\n",strerror(errno));
+  return 1;
+}
+
+int http_parse_chunked(HttpParser *p, const char *buf, size_t len, const char **data, size_t *data_len) {
+  // step through chunked body framing.  returns 1 with *data pointing at the next run of body data,
+  // 0 if more input is needed, 2 once the body is complete and -1 on error
+  while (p->posn < len) {
+    const char *s = buf+p->posn;
+    if (p->state==HTTP_CHUNK_DATA) {
+      size_t n = len-p->posn;
+      if (n > p->chunk_left) n = p->chunk_left;
+      *data = s; *data_len = n;
+      p->posn += n; p->chunk_left -= n;
+      if (p->chunk_left==0) p->state = HTTP_CHUNK_END;
+      return 1;
+    }
+    const char *nl = memchr(s, '\n', len-p->posn);
+    if (!nl) return 0;
+    const char *end = (nl>s && nl[-1]=='\r') ? nl-1 : nl;
+    p->posn = nl+1-buf;
+    switch (p->state) {
+      case HTTP_CHUNK_SIZE: {
+        const char *ext = memchr(s, ';', end-s); // ignore chunk extensions
+        p->chunk_left = parse_long(s, ext ? ext : end, 16);
+        if (p->chunk_left<0) return -1;
+        p->state = p->chunk_left ? HTTP_CHUNK_DATA : HTTP_TRAILERS;
+        break;
+      }
+      case HTTP_CHUNK_END:
+        if (end!=s) return -1;
+        p->state = HTTP_CHUNK_SIZE;
+        break;
+      case HTTP_TRAILERS:
+        if (end==s) {
+          p->state = HTTP_DONE;
+          return 2;
+        }
+        break;
+    }
+  }
+  return 0;
+}
+
+int model_scan_cfg(Model *m) {
+  // find out what we need to know about a model before loading it from its cfg file: input size (unless
+  // already given) and whether it's a detector.  returns -1 if the file can't be read
+  char line[BUFFER_SIZE];
+  int in_net=0, w=0, h=0;
+  FILE *f = fopen(m->cfgfile, "r");
+  if (!f) return -1;
+  m->detector = 0;
+  m->max_batch = MAX_BATCH;
+  while (fgets(line, sizeof(line), f)) {
+    char *s = line;
+    while (*s==' ' || *s=='\t') s++;
+    if (*s=='[') {
+      in_net = !strncmp(s, "[net]", 5) || !strncmp(s, "[network]", 9);
+      if (!strncmp(s, "[yolo]", 6)) m->detector = 1;
+      if (!strncmp(s, "[region]", 8) || !strncmp(s, "[detection]", 11)) {
+        m->detector = 1;
+        m->max_batch = 1; // only yolo layers know how to pick out the detections for each image in a batch
+      }
+    } else if (in_net) {
+      sscanf(s, "width = %d", &w);
+      sscanf(s, "height = %d", &h);
     }
-    if (rv<=0) break;
-    bytes+=rv;
-    //DEBUG_HTTP("received %d/%d/%d POST data\n", rv, bytes, content_length);
   }
-  if (rv<0) {
+  fclose(f);
+  if (!m->num_sizes) {
+    m->w[0] = w; m->h[0] = h;
+    m->num_sizes = 1;
+  }
+  return 0;
+}
+
+int parse_sizes(char *list, Model *m) {
+  // read comma separated list of input sizes into m.  returns -1 if it isn't one
+  char *end;
+  m->num_sizes = 0;
+  while (*list) {
+    long d = strtol(list, &end, 10);
+    if (end==list || (*end && *end!=',') || d<=0 || d%32 || m->num_sizes==MAX_SIZES) return -1;
+    m->w[m->num_sizes] = m->h[m->num_sizes] = d;
+    m->num_sizes++;
+    list = *end ? end+1 : end;
+  }
+  return 0;
+}
+
+int model_size(Model *m, int d) {
+  // which of model's input sizes is closest to d, 0 (the default) if d is
+  int i, best=0;
+  for (i=1; d && i<m->num_sizes; i++) {
+    if (abs(m->w[i]-d) < abs(m->w[best]-d)) best = i;
+  }
+  return best;
+}
+
+int add_model(char *name, char *cfgfile, char *weightfile, char *namesfile, char *sizes) {
+  // add a model to those served.  its files are checked now, since darknet just exits if it can't read them
+  if (num_models==MAX_MODELS) {
+    ERR("Too many models, max is %d\n", MAX_MODELS);
+    return -1;
+  }
+  if (find_model(name, name+strlen(name))) {
+    ERR("Model %s listed twice\n", name);
+    return -1;
+  }
+  if ((weightfile[0] && access(weightfile, R_OK)) || access(namesfile, R_OK)) {
+    ERR("Cannot read weights %s or names %s for model %s\n", weightfile, namesfile, name);
+    return -1;
+  }
+  Model *m = &models[num_models];
+  m->name = strdup(name);
+  m->cfgfile = strdup(cfgfile); m->weightfile = strdup(weightfile); m->namesfile = strdup(namesfile);
+  if (sizes && parse_sizes(sizes, m)<0) {
+    ERR("Model %s: sizes %s must be a list of up to %d multiples of 32, like 608,416,320\n", name, sizes, MAX_SIZES);
+    return -1;
+  }
+  if (model_scan_cfg(m)<0) {
+    ERR("Cannot read config %s for model %s\n", cfgfile, name);
+    return -1;
+  }
+  if (m->w[0]<=0 || m->h[0]<=0 || m->w[0]%32 || m->h[0]%32) {
+    ERR("Model %s: network width %d and height %d must be a multiple of 32\n", name, m->w[0], m->h[0]);
+    return -1;
+  }
+  m->names = get_labels(namesfile);
+  num_models++;
+  INFO("Model %s: %s, %dx%d%s, %s\n", name, cfgfile, m->w[0], m->h[0], m->num_sizes>1 ? " (and other sizes)" : "",
+       m->detector ? "detector" : "classifier");
+  return 0;
+}
+
+int read_models(char *file) {
+  // read the -M file, a line per model: "name cfg weights names [sizes]".  # starts a comment
+  char line[BUFFER_SIZE], name[256], cfgfile[1024], weightfile[1024], namesfile[1024], sizes[256];
+  int lineno=0;
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    ERR("Cannot open model list %s\n", file);
     return -1;
   }
-  if (bytes < content_length) {
-    ERR("POST data ended early, got %d but expected %d\n",(int)bytes,content_length);
+  while (fgets(line, sizeof(line), f)) {
+    char *hash = strchr(line, '#');
+    if (hash) *hash = 0;
+    lineno++;
+    int n = sscanf(line, "%255s %1023s %1023s %1023s %255s", name, cfgfile, weightfile, namesfile, sizes);
+    if (n<=0) continue; // blank line
+    if (n<4) {
+      ERR("%s line %d: expected name cfg weights names [sizes]\n", file, lineno);
+      fclose(f);
+      return -1;
+    }
+    if (add_model(name, cfgfile, weightfile, namesfile, n==5 ? sizes : NULL)<0) {
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+  if (num_models==0) {
+    ERR("No models in %s\n", file);
     return -1;
   }
-  *len = content_length;
-  //post_data[*len+1]='\0';printf("%s\n",post_data);
   return 0;
 }
 
-network* init(char* cfgfile, char* weightfile, int w, int h) {
-  // load config files
-  network *net = load_network(cfgfile, weightfile, 0);
-  set_batch_network(net, 1);
-  if ((net->w != w) || (net->h !=h)) {
-    DEBUG_JPG("resizing from %dx%d to %dx%d\n",net->w, net->h, w, h);
+size_t network_bytes(network *net, int params) {
+  // rough memory use of network: activations (and their deltas, which darknet always allocates), and the
+  // parameters (and their updates) if it has its own
+  int i;
+  size_t n = (size_t)net->inputs*net->batch;
+  for (i=0; i<net->n; i++) {
+    layer *l = &net->layers[i];
+    n += 2*(size_t)l->outputs*l->batch;
+    if (params) n += 2*(size_t)(l->nweights+l->nbiases);
+  }
+  return n*sizeof(float);
+}
+
+#define LAYER_PARAMS 5
+
+int layer_params(layer *l, float ***params, size_t *lens) {
+  // l's parameters (the ones share_network_weights() shares) and how many floats each is.  only convolutional and
+  // connected layers, which hold nearly all the weights.  returns how many there are
+  int i, n = l->nbiases;
+  if (l->type!=CONVOLUTIONAL && l->type!=CONNECTED) return 0;
+  if (l->nweights==0 || l->nbiases==0) return 0; // sizes unknown, leave them unshared rather than lose them
+  params[0] = &l->weights; params[1] = &l->biases; params[2] = &l->scales;
+  params[3] = &l->rolling_mean; params[4] = &l->rolling_variance;
+  lens[0] = l->nweights;
+  for (i=1; i<LAYER_PARAMS; i++) lens[i] = n;
+  return LAYER_PARAMS;
+}
+
+void* map_weights(network *net, size_t *size) {
+  // move net's parameters into one shared read-only mapping, so processes forked afterwards all use the same pages
+  // rather than each getting its own copy as they touch them.  returns the mapping, NULL on failure
+  int i, j;
+  size_t total = 0, off = 0;
+  for (i=0; i<net->n; i++) {
+    float **params[LAYER_PARAMS];
+    size_t lens[LAYER_PARAMS];
+    int np = layer_params(&net->layers[i], params, lens);
+    for (j=0; j<np; j++) if (*params[j]) total += (lens[j]*sizeof(float)+63) & ~63;
+  }
+  char *map = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (map==MAP_FAILED) return NULL;
+  for (i=0; i<net->n; i++) {
+    float **params[LAYER_PARAMS];
+    size_t lens[LAYER_PARAMS];
+    int np = layer_params(&net->layers[i], params, lens);
+    for (j=0; j<np; j++) {
+      if (!*params[j]) continue;
+      memcpy(map+off, *params[j], lens[j]*sizeof(float));
+      free(*params[j]);
+      *params[j] = (float*)(map+off);
+      off += (lens[j]*sizeof(float)+63) & ~63;
+    }
+  }
+  mprotect(map, total, PROT_READ);
+  *size = total;
+  return map;
+}
+
+void unmap_weights(network *net, void *map, size_t size) {
+  // undo map_weights(), before net is freed
+  int i, j;
+  for (i=0; i<net->n; i++) {
+    float **params[LAYER_PARAMS];
+    size_t lens[LAYER_PARAMS];
+    int np = layer_params(&net->layers[i], params, lens);
+    for (j=0; j<np; j++) {
+      if ((char*)*params[j] >= (char*)map && (char*)*params[j] < (char*)map+size) *params[j] = NULL;
+    }
+  }
+  munmap(map, size);
+}
+
+int model_batch(Model *m) {
+  // max images per pass through model's network
+  return batch_size<m->max_batch ? batch_size : m->max_batch;
+}
+
+network* model_instance(Model *m, int size) {
+  // build model's network for its size'th input size, with activations for a batch
+  int w = m->w[size], h = m->h[size];
+  network *net = parse_network_cfg_batch(m->cfgfile, model_batch(m));
+  if (net->w!=w || net->h!=h) {
+    DEBUG_JPG("resizing %s from %dx%d to %dx%d\n", m->name, net->w, net->h, w, h);
     TICK(start_resize);
-    resize_network(net,w,h);
-    DEBUG_TIME("time to resize: %f ms\n",TOCK(NOW,start_resize)*1000);    
+    resize_network(net, w, h);
+    DEBUG_TIME("time to resize: %f ms\n",TOCK(NOW,start_resize)*1000);
   }
   return net;
 }
 
-#ifdef LIBJPEG
-unsigned char* libjpg_load_from_memory(unsigned char *buff, int len, int rotation, int net_w, int net_h,
-                      int *w, int*h, int *c, float *scale) {
-    // call libjpeg-turbo to decode image pointed to by buff
-  
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPARRAY buffer;
-    int row_stride;
-    unsigned char* bbuf;
+network* model_build(Model *m) {
+  // read model's network and weights from its files
+  TICK(start_load);
+  network *net = model_instance(m, 0);
+  if (m->weightfile[0]) load_weights(net, m->weightfile);
+  DEBUG_TIME("time to load %s: %f ms\n", m->name, TOCK(NOW,start_load)*1000);
+  return net;
+}
 
-    // initialise jpeg decoder and extract image width and height from header ...
-    cinfo.err = jpeg_std_error( &jerr );
-    jpeg_create_decompress( &cinfo );
-    jpeg_mem_src( &cinfo, buff, len );
-    jpeg_read_header( &cinfo, 1 );
-    jpeg_calc_output_dimensions(&cinfo);
+void model_loaded(Model *m, network *net) {
+  // make net (from model_build()) the model's current weights.  models_mutex must be held
+  ModelNets *mn = calloc(1, sizeof(ModelNets));
+  mn->model = m;
+  mn->net = net;
+  mn->nets = calloc(m->num_sizes*num_workers, sizeof(network*));
+  mn->nets[0] = net; // worker 0 uses the instance holding the weights for the default size
+  mn->bytes = network_bytes(net, 1);
+  memory_used += mn->bytes;
+  m->loaded = mn;
+}
 
-    // calc image width and height after rotation is applied, we'll scale and trim image while
-    // decoding so that it fits into net_w by net_h box *after* rotation
-    int dst_w=cinfo.output_width, dst_h=cinfo.output_height;
-    if ((rotation%180==90) || (rotation%180==-90)) {
-       dst_w=cinfo.output_height; dst_h = cinfo.output_width;
+void model_load(Model *m) {
+  // load model's weights, if it isn't already (or being loaded by another worker).  models_mutex must be held,
+  // it's let go while loading
+  while (m->loading) pthread_cond_wait(&models_cond, &models_mutex);
+  if (m->loaded) return;
+  m->loading = 1;
+  pthread_mutex_unlock(&models_mutex);
+  INFO("Loading model %s\n", m->name);
+  network *net = model_build(m);
+  pthread_mutex_lock(&models_mutex);
+  model_loaded(m, net);
+  m->loads++;
+  m->loading = 0;
+  pthread_cond_broadcast(&models_cond);
+}
+
+float* workspace_alloc(size_t size) {
+#ifdef GPU
+  if (gpu_index >= 0) return cuda_make_array(0, (size-1)/sizeof(float)+1);
+#endif
+  return calloc(1, size);
+}
+
+void workspace_free(float *workspace) {
+#ifdef GPU
+  if (gpu_index >= 0) {
+    if (workspace) cuda_free(workspace);
+    return;
+  }
+#endif
+  free(workspace);
+}
+
+void model_nets_free(Model *m, ModelNets *mn) {
+  // free a set of model's networks.  models_mutex must be held and nobody using them
+  int i;
+  for (i=m->num_sizes*num_workers-1; i>=0; i--) {
+    network *net = mn->nets[i];
+    if (!net) continue;
+    // (the prefork master has no workers, its networks all have their own)
+    if (!workers || net->workspace != workers[i%num_workers].workspace) set_network_workspace(net, NULL);
+    if (i) {
+      free_shared_network(net, mn->net);
+    } else {
+      if (mn->map) unmap_weights(net, mn->map, mn->map_size);
+      free_network(net);
     }
+  }
+  memory_used -= mn->bytes;
+  free(mn->nets);
+  free(mn);
+}
 
-    // assuming net_w=net_h to simplify the following.  so when image w>h its enough to scale it so that its width 
-    // is less than net_w since that automatically ensures its height is less than net_h.  libjpeg-turbo allows image
-    // scaling of the form num/8 where num is an integer between 1 and 15.
+void model_retire(Model *m, ModelNets *mn) {
+  // model has stopped using mn (it's been unloaded or reloaded), free it once no worker is using it either.
+  // models_mutex must be held
+  if (mn->users==0) {
+    model_nets_free(m, mn);
+  } else {
+    mn->next = retired;
+    retired = mn;
+  }
+}
 
-    if (dst_w >= dst_h) { // landscape image, we need to scale so that width fits inside net_w wide box
-       int i;
-       for (i=15;i>0;i--) {
-          if (dst_w*i/8 <= net_w) break;
-       }
-       cinfo.scale_num=i; cinfo.scale_denom=8; 
-       *scale=cinfo.scale_num*1.0/cinfo.scale_denom;
-    } else { //portrait, need to scale so that height <= net_h
-       int i;
-       for (i=15;i>0;i--) {
-          if (dst_h*i/8 <= net_h) break;
-       }
-       cinfo.scale_num=i; cinfo.scale_denom=8; 
-       *scale=cinfo.scale_num*1.0/cinfo.scale_denom;
+void evict_models() {
+  // unload the least recently used models nobody is using until we're within the memory budget.  models_mutex
+  // must be held
+  int i;
+  while (memory_budget && memory_used > memory_budget) {
+    Model *lru = NULL;
+    for (i=0; i<num_models; i++) {
+      Model *m = &models[i];
+      if (m->loaded && !m->loaded->users && (!lru || m->last_used < lru->last_used)) lru = m;
     }
-    DEBUG_JPG("dst_w=%d,dst_h=%d,scale=%0.1f,scaled_w=%.1f,scaled_h=%.1f, net_w/h=%d\n",
-               dst_w,dst_h,*scale,dst_w*(*scale),dst_h*(*scale), net_w);
-  
-    // set decoder parameters -- try to be fast!
-    cinfo.dct_method=JDCT_FASTEST;
-    cinfo.do_fancy_upsampling=0;
-    jpeg_start_decompress( &cinfo );
-  
-    // now do the actual jpeg decoding ...
-    row_stride = cinfo.output_width * cinfo.output_components;
-    unsigned char* data = (unsigned char*)malloc(
-              cinfo.output_width * cinfo.output_height *  cinfo.output_components);
-    while( cinfo.output_scanline < cinfo.output_height ) {
-       bbuf = ( ( data + ( row_stride * cinfo.output_scanline ) ) );
-       buffer = &bbuf;
-       jpeg_read_scanlines( &cinfo, buffer, 1 );
-    }
-    jpeg_finish_decompress( &cinfo );
-    *w= cinfo.output_width; // image width
-    *h= cinfo.output_height; // image height
-    *c= cinfo.output_components;  // number of channels (3 for color image)
-    jpeg_destroy_decompress( &cinfo );
-    return data;
+    if (!lru) break; // all in use
+    INFO("Unloading model %s, %.1f MB of models loaded\n", lru->name, memory_used/1048576.0);
+    model_retire(lru, lru->loaded);
+    lru->loaded = NULL;
+    lru->evictions++;
+  }
+}
+
+void worker_workspace(Worker *wk, network *net) {
+  // switch net to the worker's workspace, growing that if need be.  models_mutex must be held
+  int i, j;
+  if (net->workspace == wk->workspace) return;
+  size_t size = get_network_workspace_size(net);
+  if (size > wk->workspace_size) {
+    float *workspace = workspace_alloc(size);
+    // repoint the worker's other networks, including those of reloaded models still being retired
+    for (i=0; i<=num_models; i++) {
+      ModelNets *mn = i<num_models ? models[i].loaded : retired;
+      for (; mn; mn = i<num_models ? NULL : mn->next) {
+        for (j=0; j<mn->model->num_sizes; j++) {
+          network *other = mn->nets[j*num_workers+wk->id];
+          if (other && other->workspace==wk->workspace) other->workspace = workspace;
+        }
+      }
+    }
+    workspace_free(wk->workspace);
+    wk->workspace = workspace;
+    wk->workspace_size = size;
+  }
+  set_network_workspace(net, wk->workspace);
+}
+
+network* model_acquire(Worker *wk, Model *m, int size) {
+  // the worker's instance of model m at its size'th input size, loading the model if need be.  call
+  // model_release() when done with it
+  pthread_mutex_lock(&models_mutex);
+  model_load(m);
+  ModelNets *mn = m->loaded;
+  mn->users++;
+  wk->using = mn;
+  network *net = mn->nets[size*num_workers+wk->id];
+  if (!net) { // worker hasn't run this model at this size before
+    pthread_mutex_unlock(&models_mutex);
+    net = model_instance(m, size);
+    share_network_weights(net, mn->net);
+    size_t bytes = network_bytes(net, 0);
+    pthread_mutex_lock(&models_mutex);
+    mn->nets[size*num_workers+wk->id] = net;
+    mn->bytes += bytes;
+    memory_used += bytes;
+  }
+  worker_workspace(wk, net);
+  evict_models(); // make room for what's just been loaded
+  pthread_mutex_unlock(&models_mutex);
+  size_t inputs = (size_t)model_batch(m)*net->inputs;
+  if (inputs > wk->input_size) { // batches are gathered here, cascade crops letterboxed straight in
+    free(wk->input);
+    wk->input = calloc(inputs, sizeof(float));
+    wk->input_size = inputs;
+  }
+  return net;
+}
+
+void model_release(Worker *wk, Model *m, int n) {
+  // worker has finished running n requests through model m
+  ModelNets *mn = wk->using, **p;
+  pthread_mutex_lock(&models_mutex);
+  mn->users--;
+  if (mn->users==0 && mn != m->loaded) { // last user of a reloaded model's old networks
+    for (p=&retired; *p; p=&(*p)->next) {
+      if (*p==mn) {
+        *p = mn->next;
+        model_nets_free(m, mn);
+        break;
+      }
+    }
+  }
+  m->requests += n;
+  m->last_used = now_us();
+  pthread_mutex_unlock(&models_mutex);
+  wk->using = NULL;
+}
+
+// Hot reload.  On SIGHUP, or POST /reload (or /<model>/reload), the loaded models are read in again from their
+// files in the background and warmed up with a pass through the network, then swapped in.  Requests already with
+// a worker finish on the old networks, which are freed once the last of them is done.  In prefork mode the server
+// processes leave it to the master, see master_reload().
+sem_t reload_sem;
+volatile sig_atomic_t reload_all = 0; // set by SIGHUP
+
+void on_sighup(int sig) {
+  reload_all = 1;
+  sem_post(&reload_sem); // safe in a signal handler
+}
+
+pid_t master_pid = 0;   // the prefork master, in its server processes
+
+void request_reload(Model *m) {
+  // reload m, or all models if NULL
+  int i;
+  if (master_pid) { // a server process can't reload the shared weights itself, the master reloads all models
+    kill(master_pid, SIGHUP);
+    return;
+  }
+  for (i=0; i<num_models; i++) {
+    if (!m || m==&models[i]) __sync_lock_test_and_set(&models[i].reload, 1);
+  }
+  sem_post(&reload_sem);
+}
+
+int model_reload(Model *m) {
+  // read in model again and swap it in.  returns 0 if it couldn't
+  if ((m->weightfile[0] && access(m->weightfile, R_OK)) || access(m->cfgfile, R_OK)) {
+    ERR("Cannot read config %s or weights %s, not reloading model %s\n", m->cfgfile, m->weightfile, m->name);
+    return 0;
+  }
+  INFO("Reloading model %s\n", m->name);
+  network *net = model_build(m);
+  float *input = calloc((size_t)net->batch*net->inputs, sizeof(float));
+  network_predict(net, input); // warm up
+  free(input);
+  pthread_mutex_lock(&models_mutex);
+  if (m->loaded) {
+    model_retire(m, m->loaded);
+    model_loaded(m, net);
+    m->reloads++;
+    evict_models();
+    net = NULL;
+  }
+  pthread_mutex_unlock(&models_mutex);
+  if (net) { // unloaded while we were at it, leave it that way
+    set_network_workspace(net, NULL);
+    free_network(net);
+  }
+  return 1;
 }
+
+void* reload_thread(void* param) {
+  // reload models when asked to
+  int i;
+#ifdef GPU
+  cuda_set_device(gpu_index);
 #endif
+  while (1) {
+    while (sem_wait(&reload_sem) && errno==EINTR);
+    if (reload_all) {
+      reload_all = 0;
+      request_reload(NULL);
+    }
+    for (i=0; i<num_models; i++) {
+      // only loaded models need it, others will be read from their files when next loaded
+      if (__sync_lock_test_and_set(&models[i].reload, 0) && models[i].loaded) model_reload(&models[i]);
+    }
+  }
+  return NULL;
+}
+
+void init_workers() {
+  // start the pipeline threads, with the default model loaded.  the others are loaded when first needed
+  int i;
+  pthread_t thread;
+  for (i=0; i<num_models; i++) {
+    if (batch_size>1 && models[i].max_batch==1) {
+      WARN("Model %s has region/detection layers, which can't be batched.  Using batch size 1 for it\n", models[i].name);
+    }
+  }
+  workers = calloc(num_workers, sizeof(Worker));
+  pthread_mutex_lock(&models_mutex);
+  model_load(&models[0]);
+  pthread_mutex_unlock(&models_mutex);
+  stats.start_time = now_us();
+  // just enough decoded images to fill every worker's next batch.  any backlog stays in the request
+  // queue, where deadlines and latest-frame-wins apply
+  stage_queue_init(&infer_queue, num_workers*batch_size);
+  stage_queue_init(&post_queue, 2*num_workers*batch_size);
+  for (i=0; i<num_decoders; i++) {
+    if (pthread_create(&thread, NULL, decode_thread, (void*)(intptr_t)i) != 0) {
+      ERR("Failed to create decode thread %d\n", i);
+      exit(-1);
+    }
+  }
+  for (i=0; i<num_posters; i++) {
+    if (pthread_create(&thread, NULL, post_thread, NULL) != 0) {
+      ERR("Failed to create NMS/response thread %d\n", i);
+      exit(-1);
+    }
+  }
+  sem_init(&reload_sem, 0, 0);
+  if (pthread_create(&thread, NULL, reload_thread, NULL) != 0) {
+    ERR("Failed to create reload thread\n");
+    exit(-1);
+  }
+  signal(SIGHUP, on_sighup);
+  for (i=0; i<num_workers; i++) {
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, worker_thread, (void*)&workers[i]) != 0) {
+      ERR("Failed to create worker thread %d\n", i);
+      exit(-1);
+    }
+  }
+  INFO("Started %d decode threads, %d inference workers (batch size %d) and %d NMS/response threads, serving %d model%s\n",
+       num_decoders, num_workers, batch_size, num_posters, num_models, num_models>1 ? "s" : "");
+}
 
 inline float u8tofloat(uint8_t x){
    // see http://lolengine.net/blog/2011/3/20/understanding-fast-float-integer-conversions
@@ -339,537 +1348,2374 @@ inline float u8tofloat(uint8_t x){
    return u.f - 32768.0f;
 }
 
-int load_image_mem(unsigned char *buff, int len, int rotation, int net_w, int net_h, 
-                                unsigned char** rgb_data, int *w, int *h, int *c, float *scale) {
-    // try to decode contents of buff as jpeg image and rescale to width net_w pixels.
-    // scale is set to scaling applied 
+// Letterboxing.  A decoded image goes straight into the network input tensor (planar floats, net_w by net_h, in a
+// pool buffer) in one pass: each pixel is rotated, converted and written to its place, and only the padding around
+// it is cleared.  Decoders hand over rows as they're decoded, so there's no whole-image copy in between.  Images
+// still too big for the network (when the decoder couldn't scale them down far enough, or stb which can't scale
+// at all) are scaled down on the way in by the YuvScaler below, which needs the whole image
+typedef struct Letterbox {
+  float *out;
+  int net_w, net_h;
+  int w, h, c; // decoded image (c is 1 for greyscale, otherwise RGB with c bytes per pixel)
+  int rotation; // 0, 90, 180 or 270
+  int fits; // image fits the network as it is
+  float scale; // applied on top of any scaling by the decoder, 1 if it fits
+  int pad_w, pad_h; // where the image starts in out
+  int out_w, out_h; // and its size there
+} Letterbox;
+
+void letterbox_start(Letterbox *lb, float *out, int net_w, int net_h, int w, int h, int c, int rotation) {
+  // set up lb to put a w x h image, to be rotated by rotation, into out.  clears the padding
+  int i, j, k;
+  rotation = (rotation%360+360)%360;
+  lb->rotation = rotation%90 ? 0 : rotation;
+  lb->out = out;
+  lb->net_w = net_w; lb->net_h = net_h;
+  lb->w = w; lb->h = h; lb->c = c;
+  int w_rot = lb->rotation%180 ? h : w, h_rot = lb->rotation%180 ? w : h;
+  lb->fits = w_rot<=net_w && h_rot<=net_h;
+  lb->scale = lb->fits ? 1 : fminf((float)net_w/w_rot, (float)net_h/h_rot);
+  lb->out_w = lb->fits ? w_rot : w_rot*lb->scale; lb->out_h = lb->fits ? h_rot : h_rot*lb->scale;
+  if (lb->out_w<1) lb->out_w = 1;
+  if (lb->out_h<1) lb->out_h = 1;
+  lb->pad_w = (net_w-lb->out_w)/2; lb->pad_h = (net_h-lb->out_h)/2;
+  for (k=0; k<3; k++) {
+    float *plane = out + (size_t)net_w*net_h*k;
+    memset(plane, 0, (size_t)net_w*lb->pad_h*sizeof(float));
+    for (j=lb->pad_h; j<lb->pad_h+lb->out_h; j++) {
+      float *row = plane + (size_t)net_w*j;
+      for (i=0; i<lb->pad_w; i++) row[i] = 0;
+      for (i=lb->pad_w+lb->out_w; i<net_w; i++) row[i] = 0;
+    }
+    memset(plane + (size_t)net_w*(lb->pad_h+lb->out_h), 0, (size_t)net_w*(net_h-lb->pad_h-lb->out_h)*sizeof(float));
+  }
+}
+
+void letterbox_row(Letterbox *lb, const unsigned char *src, int j) {
+  // put row j of the image (which must fit) in place
+  int i, nw = lb->net_w, w = lb->w, h = lb->h, c = lb->c;
+  size_t plane = (size_t)nw*lb->net_h;
+  float *R = lb->out + (size_t)lb->pad_h*nw + lb->pad_w, *G = R+plane, *B = G+plane;
+  long o, step; // where the row's first pixel goes, and how far apart its pixels go
+  switch (lb->rotation) {
+    case 90: o = h-1-j; step = nw; break;
+    case 180: o = (long)(h-1-j)*nw + w-1; step = -1; break;
+    case 270: o = (long)(w-1)*nw + j; step = -nw; break;
+    default: o = (long)j*nw; step = 1;
+  }
+  if (c>=3) {
+    for (i=0; i<w; i++, o+=step, src+=c) {
+      R[o] = u8tofloat(src[0]); G[o] = u8tofloat(src[1]); B[o] = u8tofloat(src[2]);
+    }
+  } else {
+    for (i=0; i<w; i++, o+=step, src++) R[o] = G[o] = B[o] = u8tofloat(src[0]);
+  }
+}
+
+// Raw YUV frames.  Phones give camera frames as NV21 (Android's default), NV12, I420 or YUYV, which clients can send
+// as they are rather than spend time and battery compressing them.  A YuvScaler converts one to RGB and scales it to
+// the size wanted in the same pass, a row at a time, so only output pixels are computed: each output row is blended
+// from the source rows under it (box filter, the mean of the rows it covers, when shrinking by 2 or more, otherwise
+// bilinear), then each output pixel from the samples in that row, and then converted to RGB.  The blending and
+// conversion use SSE2 or AVX2 (build with AVX2=1) where available.  Rows are made a tile at a time and go straight
+// into the network input, rotated and letterboxed, so there's no RGB image in between.  Decoded images too big for
+// the network are scaled the same way, without the colour conversion.
+#define YUV_TILE 16 // rows converted before they're written out, so rotated tiles are written a run of floats at a time
+
+int yuv_size(int fmt, int w, int h) {
+  // bytes in a w x h frame, -1 if it can't be that size
+  if (w<=0 || h<=0 || fmt<YUV_NV21 || fmt>YUV_YUYV) return -1;
+  if (fmt==YUV_YUYV) return w%2 ? -1 : w*h*2;
+  return w*h + (w+1)/2*((h+1)/2)*2;
+}
+
+typedef struct YuvPlane { // n rows of stride bytes, and the filter taking them to output rows
+  const uint8_t *data;
+  int stride, n;
+  int *first, *count;
+  float *weight; // for next row
+  float *row; // blended rows of the current output row
+} YuvPlane;
+
+typedef struct YuvComp { // where the samples of Y, U or V are, and the filter taking them to output columns
+  int plane, off, step;
+  int *first, *count;
+  float *weight;
+  int pairs; // each output from two samples (bilinear, or box when shrinking by exactly 2)
+  float *out; // current output row
+} YuvComp;
+
+typedef struct YuvScaler {
+  int out_w, out_h, y; // output size and next row
+  int nplanes;
+  YuvPlane plane[3];
+  YuvComp comp[3]; // Y, U, V (or R, G, B)
+  int rgb_in; // no colour conversion, just scaling
+  uint8_t *rgb[3]; // tile of output rows, planar, out_w apart
+  char *scratch;
+} YuvScaler;
+
+int yuv_taps(int n, int m, int *first, int *count, float *weight) {
+  // filter to resample n samples to m, output i being the weighted sum of count[i] samples from first[i] (weights in
+  // order).  returns number of weights, at most n+2*m
+  int i, t, k=0;
+  float f = (float)n/m;
+  for (i=0; i<m; i++) {
+    if (f>=2) { // box
+      int a = (long)i*n/m, b = (long)(i+1)*n/m;
+      first[i] = a; count[i] = b-a;
+      for (t=a; t<b; t++) weight[k++] = 1.f/(b-a);
+    } else if (n>1) { // bilinear
+      float s = (i+.5f)*f - .5f;
+      s = s<0 ? 0 : s>n-1 ? n-1 : s;
+      int a = s<n-2 ? (int)s : n-2;
+      first[i] = a; count[i] = 2;
+      weight[k++] = 1-(s-a); weight[k++] = s-a;
+    } else {
+      first[i] = 0; count[i] = 1; weight[k++] = 1;
+    }
+  }
+  return k;
+}
+
+int yuv_start(YuvScaler *s, int fmt, const uint8_t *yuv, int w, int h, int out_w, int out_h) {
+  // set up s to convert w x h frame yuv to an out_w x out_h RGB image.  returns -1 if out of memory
+  int i, x, cw = (w+1)/2, ch = (h+1)/2, cols[3];
+  s->out_w = out_w; s->out_h = out_h; s->y = 0;
+  s->plane[0].data = yuv; s->plane[0].stride = w; s->plane[0].n = h;
+  s->comp[0].plane = 0; s->comp[0].off = 0; s->comp[0].step = 1;
+  cols[0] = w; cols[1] = cols[2] = cw;
+  switch (fmt) {
+    case YUV_NV21: case YUV_NV12: // Y plane then interleaved VU (or UV) at half resolution
+      s->nplanes = 2;
+      s->plane[1].data = yuv+w*h; s->plane[1].stride = cw*2; s->plane[1].n = ch;
+      s->comp[1].plane = s->comp[2].plane = 1;
+      s->comp[1].off = fmt==YUV_NV21; s->comp[2].off = fmt==YUV_NV12;
+      s->comp[1].step = s->comp[2].step = 2;
+      break;
+    case YUV_I420: // Y, U and V planes
+      s->nplanes = 3;
+      for (i=1; i<3; i++) {
+        s->plane[i].data = yuv + w*h + cw*ch*(i-1); s->plane[i].stride = cw; s->plane[i].n = ch;
+        s->comp[i].plane = i; s->comp[i].off = 0; s->comp[i].step = 1;
+      }
+      break;
+    case YUV_YUYV: // Y0 U Y1 V, chroma at half horizontal resolution
+      s->nplanes = 1;
+      s->plane[0].stride = w*2;
+      s->comp[0].step = 2;
+      for (i=1; i<3; i++) {
+        s->comp[i].plane = 0; s->comp[i].off = i*2-1; s->comp[i].step = 4;
+      }
+      cols[1] = cols[2] = w/2;
+      break;
+    default: // RGB or greyscale, all three from the one plane
+      s->nplanes = 1;
+      s->plane[0].stride = fmt==YUV_RGB ? w*3 : w;
+      for (i=0; i<3; i++) {
+        s->comp[i].plane = 0; s->comp[i].off = fmt==YUV_RGB ? i : 0; s->comp[i].step = fmt==YUV_RGB ? 3 : 1;
+      }
+      cols[1] = cols[2] = w;
+  }
+  s->rgb_in = fmt>=YUV_RGB;
+  // carve everything out of one pool buffer
+  size_t size = 3*(YUV_TILE*out_w + 16);
+  for (i=0; i<s->nplanes; i++)
+    size += 2*out_h*sizeof(int) + (s->plane[i].n+2*out_h)*sizeof(float) + s->plane[i].stride*sizeof(float) + 16;
+  for (i=0; i<3; i++) size += 2*out_w*sizeof(int) + (cols[i]+2*out_w)*sizeof(float) + out_w*sizeof(float) + 16;
+  char *p = s->scratch = pool_get(size);
+  if (!p) return -1;
+  #define CARVE(ptr, n) (ptr = (void*)p, p += ((n)*sizeof(*ptr)+15)&~(size_t)15)
+  for (i=0; i<s->nplanes; i++) {
+    CARVE(s->plane[i].row, s->plane[i].stride);
+    CARVE(s->plane[i].first, out_h); CARVE(s->plane[i].count, out_h);
+    CARVE(s->plane[i].weight, s->plane[i].n+2*out_h);
+    yuv_taps(s->plane[i].n, out_h, s->plane[i].first, s->plane[i].count, s->plane[i].weight);
+  }
+  for (i=0; i<2; i++) {
+    CARVE(s->comp[i].first, out_w); CARVE(s->comp[i].count, out_w);
+    CARVE(s->comp[i].weight, cols[i]+2*out_w);
+    yuv_taps(cols[i], out_w, s->comp[i].first, s->comp[i].count, s->comp[i].weight);
+    for (x=0, s->comp[i].pairs=1; x<out_w; x++) s->comp[i].pairs &= s->comp[i].count[x]==2;
+  }
+  // V samples are placed like U
+  s->comp[2].first = s->comp[1].first; s->comp[2].count = s->comp[1].count;
+  s->comp[2].weight = s->comp[1].weight; s->comp[2].pairs = s->comp[1].pairs;
+  for (i=0; i<3; i++) CARVE(s->comp[i].out, out_w);
+  for (i=0; i<3; i++) CARVE(s->rgb[i], YUV_TILE*out_w);
+  #undef CARVE
+  return 0;
+}
+
+void yuv_end(YuvScaler *s) {
+  pool_put(s->scratch);
+  s->scratch = NULL;
+}
+
+void yuv_blend_row(float *dst, const uint8_t *src, float wt, int n, int add) {
+  // dst = (add ? dst : 0) + wt*src
+  int i=0;
+#if defined(__AVX2__)
+  __m256 w8 = _mm256_set1_ps(wt);
+  for (; i+8<=n; i+=8) {
+    __m256 v = _mm256_mul_ps(w8, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src+i)))));
+    _mm256_storeu_ps(dst+i, add ? _mm256_add_ps(_mm256_loadu_ps(dst+i), v) : v);
+  }
+#elif defined(__SSE2__)
+  __m128 w4 = _mm_set1_ps(wt);
+  __m128i zero = _mm_setzero_si128();
+  for (; i+8<=n; i+=8) {
+    __m128i v16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+i)), zero);
+    __m128 lo = _mm_mul_ps(w4, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero)));
+    __m128 hi = _mm_mul_ps(w4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, zero)));
+    if (add) {
+      lo = _mm_add_ps(_mm_loadu_ps(dst+i), lo);
+      hi = _mm_add_ps(_mm_loadu_ps(dst+i+4), hi);
+    }
+    _mm_storeu_ps(dst+i, lo); _mm_storeu_ps(dst+i+4, hi);
+  }
+#endif
+  for (; i<n; i++) dst[i] = (add ? dst[i] : 0) + wt*src[i];
+}
+
+// YUV to RGB, using the BT.601 coefficients of the integer code this replaced (1192ths)
+#define YUV_RV (1634.f/1192)
+#define YUV_GV (833.f/1192)
+#define YUV_GU (400.f/1192)
+#define YUV_BU (2066.f/1192)
+
+void yuv_rgb_row(const float *Y, const float *U, const float *V, int n, uint8_t *R, uint8_t *G, uint8_t *B) {
+  // convert n pixels, rounding and clamping to 0-255
+  int i=0;
+#if defined(__AVX2__)
+  __m256 c128 = _mm256_set1_ps(128), rv = _mm256_set1_ps(YUV_RV), gv = _mm256_set1_ps(YUV_GV);
+  __m256 gu = _mm256_set1_ps(YUV_GU), bu = _mm256_set1_ps(YUV_BU);
+  for (; i+16<=n; i+=16) {
+    __m256i r[2], g[2], b[2];
+    int k;
+    for (k=0; k<2; k++) {
+      __m256 y = _mm256_loadu_ps(Y+i+k*8);
+      __m256 u = _mm256_sub_ps(_mm256_loadu_ps(U+i+k*8), c128), v = _mm256_sub_ps(_mm256_loadu_ps(V+i+k*8), c128);
+      r[k] = _mm256_cvtps_epi32(_mm256_add_ps(y, _mm256_mul_ps(rv, v)));
+      g[k] = _mm256_cvtps_epi32(_mm256_sub_ps(y, _mm256_add_ps(_mm256_mul_ps(gv, v), _mm256_mul_ps(gu, u))));
+      b[k] = _mm256_cvtps_epi32(_mm256_add_ps(y, _mm256_mul_ps(bu, u)));
+    }
+    // saturating packs work within 128 bit lanes, so put the 16 bit values back in order before the last one
+    #define PACK16(a, dst) do { \
+      __m256i s16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(a[0], a[1]), 0xd8); \
+      _mm_storeu_si128((__m128i*)(dst), _mm_packus_epi16(_mm256_castsi256_si128(s16), _mm256_extracti128_si256(s16, 1))); \
+    } while (0)
+    PACK16(r, R+i); PACK16(g, G+i); PACK16(b, B+i);
+    #undef PACK16
+  }
+#elif defined(__SSE2__)
+  __m128 c128 = _mm_set1_ps(128), rv = _mm_set1_ps(YUV_RV), gv = _mm_set1_ps(YUV_GV);
+  __m128 gu = _mm_set1_ps(YUV_GU), bu = _mm_set1_ps(YUV_BU);
+  for (; i+16<=n; i+=16) {
+    __m128i r[4], g[4], b[4];
+    int k;
+    for (k=0; k<4; k++) {
+      __m128 y = _mm_loadu_ps(Y+i+k*4);
+      __m128 u = _mm_sub_ps(_mm_loadu_ps(U+i+k*4), c128), v = _mm_sub_ps(_mm_loadu_ps(V+i+k*4), c128);
+      r[k] = _mm_cvtps_epi32(_mm_add_ps(y, _mm_mul_ps(rv, v)));
+      g[k] = _mm_cvtps_epi32(_mm_sub_ps(y, _mm_add_ps(_mm_mul_ps(gv, v), _mm_mul_ps(gu, u))));
+      b[k] = _mm_cvtps_epi32(_mm_add_ps(y, _mm_mul_ps(bu, u)));
+    }
+    #define PACK16(a, dst) \
+      _mm_storeu_si128((__m128i*)(dst), _mm_packus_epi16(_mm_packs_epi32(a[0], a[1]), _mm_packs_epi32(a[2], a[3])))
+    PACK16(r, R+i); PACK16(g, G+i); PACK16(b, B+i);
+    #undef PACK16
+  }
+#endif
+  for (; i<n; i++) {
+    float y = Y[i], u = U[i]-128, v = V[i]-128;
+    float r = y + YUV_RV*v, g = y - YUV_GV*v - YUV_GU*u, b = y + YUV_BU*u;
+    R[i] = r<0 ? 0 : r>255 ? 255 : (uint8_t)lrintf(r);
+    G[i] = g<0 ? 0 : g>255 ? 255 : (uint8_t)lrintf(g);
+    B[i] = b<0 ? 0 : b>255 ? 255 : (uint8_t)lrintf(b);
+  }
+}
+
+void yuv_pack_row(const float *src, int n, uint8_t *dst) {
+  // round n values to bytes, clamping to 0-255
+  int i=0;
+#if defined(__AVX2__)
+  for (; i+16<=n; i+=16) {
+    __m256i s16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(src+i)),
+                                                              _mm256_cvtps_epi32(_mm256_loadu_ps(src+i+8))), 0xd8);
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(_mm256_castsi256_si128(s16), _mm256_extracti128_si256(s16, 1)));
+  }
+#elif defined(__SSE2__)
+  for (; i+16<=n; i+=16) {
+    __m128i a = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src+i)), _mm_cvtps_epi32(_mm_loadu_ps(src+i+4)));
+    __m128i b = _mm_packs_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src+i+8)), _mm_cvtps_epi32(_mm_loadu_ps(src+i+12)));
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(a, b));
+  }
+#endif
+  for (; i<n; i++) dst[i] = src[i]<0 ? 0 : src[i]>255 ? 255 : (uint8_t)lrintf(src[i]);
+}
+
+void yuv_next_row(YuvScaler *s, int slot) {
+  // compute the next output row into s->rgb, as row slot of the tile
+  int i, k, t, x;
+  for (i=0; i<s->nplanes; i++) { // vertical
+    YuvPlane *p = &s->plane[i];
+    int first = p->first[s->y], count = p->count[s->y];
+    for (t=0; t<count; t++) {
+      if (t && p->weight[t]==0) continue; // the usual case when not scaling
+      yuv_blend_row(p->row, p->data + (size_t)(first+t)*p->stride, p->weight[t], p->stride, t);
+    }
+    p->weight += count;
+  }
+  for (i=0; i<3; i++) { // horizontal
+    YuvComp *c = &s->comp[i];
+    const float *row = s->plane[c->plane].row + c->off, *wt = c->weight;
+    int step = c->step;
+    if (c->pairs) {
+      for (x=0; x<s->out_w; x++, wt+=2) {
+        const float *src = row + c->first[x]*step;
+        c->out[x] = wt[0]*src[0] + wt[1]*src[step];
+      }
+      continue;
+    }
+    for (x=0; x<s->out_w; x++) {
+      const float *src = row + c->first[x]*step;
+      float sum = 0;
+      for (k=0; k<c->count[x]; k++) sum += *wt++ * src[k*step];
+      c->out[x] = sum;
+    }
+  }
+  size_t o = (size_t)slot*s->out_w;
+  if (s->rgb_in) {
+    for (i=0; i<3; i++) yuv_pack_row(s->comp[i].out, s->out_w, s->rgb[i]+o);
+  } else {
+    yuv_rgb_row(s->comp[0].out, s->comp[1].out, s->comp[2].out, s->out_w, s->rgb[0]+o, s->rgb[1]+o, s->rgb[2]+o);
+  }
+  s->y++;
+}
+
+void letterbox_tile(Letterbox *lb, uint8_t *rgb[3], int j0, int rows) {
+  // put rows j0.. of the image (which must fit), given as planar RGB lb->w apart, in place.  rotated by 90 or 270
+  // the rows become columns, so they're written a column of the tile (a run of floats in a row of out) at a time
+  int i, j, k, nw = lb->net_w, w = lb->w;
+  size_t plane = (size_t)nw*lb->net_h;
+  float *base = lb->out + (size_t)lb->pad_h*nw + lb->pad_w;
+  long o[YUV_TILE], step = 1; // where each row's first pixel goes, and how far apart its pixels go
+  for (j=0; j<rows; j++) {
+    switch (lb->rotation) {
+      case 90: o[j] = lb->h-1-(j0+j); step = nw; break;
+      case 180: o[j] = (long)(lb->h-1-(j0+j))*nw + w-1; step = -1; break;
+      case 270: o[j] = (long)(w-1)*nw + j0+j; step = -nw; break;
+      default: o[j] = (long)(j0+j)*nw; step = 1;
+    }
+  }
+  for (k=0; k<3; k++) {
+    float *dst = base + plane*k;
+    const uint8_t *src = rgb[k];
+    if (lb->rotation%180==0) {
+      for (j=0; j<rows; j++, src+=w) {
+        float *d = dst + o[j];
+        if (step==1) for (i=0; i<w; i++) d[i] = u8tofloat(src[i]);
+        else for (i=0; i<w; i++) d[-i] = u8tofloat(src[i]);
+      }
+    } else {
+      for (i=0; i<w; i++) {
+        float *d = dst + o[0] + i*step; // the tile's rows go to consecutive floats, backwards for 90
+        if (lb->rotation==90) for (j=0; j<rows; j++) d[-j] = u8tofloat(src[(size_t)j*w+i]);
+        else for (j=0; j<rows; j++) d[j] = u8tofloat(src[(size_t)j*w+i]);
+      }
+    }
+  }
+}
+
+int letterbox_yuv(Letterbox *lb, const uint8_t *yuv, int fmt, int w, int h) {
+  // convert w x h frame yuv, scaling it to lb's image size, into lb.  returns -1 if out of memory
+  YuvScaler s;
+  int j, t;
+  if (yuv_start(&s, fmt, yuv, w, h, lb->w, lb->h)<0) return -1;
+  for (j=0; j<lb->h; j+=YUV_TILE) {
+    int rows = lb->h-j<YUV_TILE ? lb->h-j : YUV_TILE;
+    for (t=0; t<rows; t++) yuv_next_row(&s, t);
+    letterbox_tile(lb, s.rgb, j, rows);
+  }
+  yuv_end(&s);
+  return 0;
+}
+
+int letterbox_image_rgb(Letterbox *lb, const unsigned char *src) {
+  // put the whole decoded image in place, scaling it down in the same pass if it doesn't fit.  returns -1 if out
+  // of memory
+  int j, w = lb->w, h = lb->h;
+  if (lb->fits) {
+    for (j=0; j<h; j++) letterbox_row(lb, src+(size_t)j*w*lb->c, j);
+    return 0;
+  }
+  // to the size it has in out (unrotated), which fits
+  lb->w = lb->rotation%180 ? lb->out_h : lb->out_w; lb->h = lb->rotation%180 ? lb->out_w : lb->out_h;
+  return letterbox_yuv(lb, src, lb->c>=3 ? YUV_RGB : YUV_GREY, w, h);
+}
+
+#ifdef LIBJPEG
+// Each decode thread has its own libjpeg decompressor, set up once and reused for every image.  Errors in an image
+// longjmp back to the decoder rather than exiting (libjpeg's default), and the image is dropped.
+typedef struct JpegDecoder {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  jmp_buf env;
+  unsigned char *data; // whole image, when it's too big to letterbox a row at a time (pool buffer)
+} JpegDecoder;
+
+void jpeg_error(j_common_ptr cinfo) {
+  JpegDecoder *dec = (JpegDecoder*)cinfo;
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  ERR("Cannot load image: %s\n", msg);
+  longjmp(dec->env, 1);
+}
+
+JpegDecoder* jpeg_decoder_new(void) {
+  JpegDecoder *dec = calloc(1, sizeof(JpegDecoder));
+  dec->cinfo.err = jpeg_std_error(&dec->jerr);
+  dec->jerr.error_exit = jpeg_error;
+  jpeg_create_decompress(&dec->cinfo);
+  return dec;
+}
+
+int libjpg_load_from_memory(JpegDecoder *dec, unsigned char *buff, int len, int rotation, int net_w, int net_h,
+                      float *out, Letterbox *lb, float *scale, Roi *roi) {
+    // call libjpeg-turbo to decode image pointed to by buff, letterboxing it into out as it's decoded.  only the
+    // region roi of it is decoded (after clipping it to the image), the rest is skipped
+    struct jpeg_decompress_struct *cinfo = &dec->cinfo;
+    JSAMPARRAY buffer;
+    int row_stride;
+
+    dec->data = NULL;
+    if (setjmp(dec->env)) { // libjpeg error
+       jpeg_abort_decompress(cinfo);
+       pool_put((char*)dec->data);
+       return -1;
+    }
+
+    // initialise jpeg decoder and extract image width and height from header ...
+    jpeg_mem_src( cinfo, buff, len );
+    jpeg_read_header( cinfo, 1 );
+    int img_w = cinfo->image_width, img_h = cinfo->image_height;
+    roi->img_w = img_w; roi->img_h = img_h;
+    if (roi->w) { // clip to image
+       if (roi->x >= img_w || roi->y >= img_h) {
+          ERR("Crop %d,%d,%d,%d is outside %dx%d image\n", roi->x, roi->y, roi->w, roi->h, img_w, img_h);
+          jpeg_abort_decompress(cinfo);
+          return -1;
+       }
+       if (roi->w > img_w-roi->x) roi->w = img_w-roi->x;
+       if (roi->h > img_h-roi->y) roi->h = img_h-roi->y;
+    } else {
+       roi->x = roi->y = 0; roi->w = img_w; roi->h = img_h;
+    }
+
+    // calc region's width and height after rotation is applied, we'll scale and trim image while
+    // decoding so that it fits into net_w by net_h box *after* rotation
+    int dst_w=roi->w, dst_h=roi->h;
+    if ((rotation%180==90) || (rotation%180==-90)) {
+       dst_w=roi->h; dst_h = roi->w;
+    }
+
+    // libjpeg-turbo allows image scaling of the form num/8 where num is an integer between 1 and 15.  pick the
+    // largest that brings the long side (after rotation) within the network's size on that side; the other side
+    // isn't checked, so with a non-square network it can still be too big, and letterbox_start() then scales the
+    // decoded rows down the rest of the way to fit net_w by net_h.
+
+    if (dst_w >= dst_h) { // landscape image, we need to scale so that width fits inside net_w wide box
+       int i;
+       for (i=15;i>1;i--) {
+          if (dst_w*i/8 <= net_w) break;
+       }
+       cinfo->scale_num=i; cinfo->scale_denom=8; 
+       *scale=cinfo->scale_num*1.0/cinfo->scale_denom;
+    } else { //portrait, need to scale so that height <= net_h
+       int i;
+       for (i=15;i>1;i--) {
+          if (dst_h*i/8 <= net_h) break;
+       }
+       cinfo->scale_num=i; cinfo->scale_denom=8; 
+       *scale=cinfo->scale_num*1.0/cinfo->scale_denom;
+    }
+    DEBUG_JPG("dst_w=%d,dst_h=%d,scale=%0.1f,scaled_w=%.1f,scaled_h=%.1f, net_w/h=%d\n",
+               dst_w,dst_h,*scale,dst_w*(*scale),dst_h*(*scale), net_w);
+  
+    // set decoder parameters -- try to be fast!  but merged upsampling (what libjpeg uses for 2x chroma without
+    // fancy upsampling) overruns its buffers when cropping or skipping rows in libjpeg-turbo up to 2.0.x
+    int whole = roi->w==img_w && roi->h==img_h;
+    cinfo->dct_method=JDCT_FASTEST;
+    cinfo->do_fancy_upsampling=!whole;
+    jpeg_start_decompress( cinfo );
+
+    // region in scaled image.  libjpeg can only crop to whole iMCUs, so it may decode a few columns either side
+    int out_w = cinfo->output_width, out_h = cinfo->output_height, c = cinfo->output_components;
+    int x0 = (long)roi->x*out_w/img_w, x1 = ((long)(roi->x+roi->w)*out_w + img_w-1)/img_w;
+    int y0 = (long)roi->y*out_h/img_h, y1 = ((long)(roi->y+roi->h)*out_h + img_h-1)/img_h;
+    JDIMENSION crop_x = x0, crop_w = x1-x0;
+    if (crop_w < out_w) jpeg_crop_scanline(cinfo, &crop_x, &crop_w);
+    int dx = (x0-crop_x)*c; // where the region starts in each row
+    if (y0) jpeg_skip_scanlines(cinfo, y0);
+  
+    // now do the actual jpeg decoding, a row at a time straight into the network input unless the image is too
+    // big even at 1/8 scale and has to be scaled down as a whole
+    letterbox_start(lb, out, net_w, net_h, x1-x0, y1-y0, c, rotation);
+    row_stride = cinfo->output_width * c;
+    if (!lb->fits && !(dec->data = (unsigned char*)pool_get((size_t)(x1-x0)*c*(y1-y0)))) longjmp(dec->env, 1);
+    buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE, row_stride, 1);
+    while( cinfo->output_scanline < y1 ) {
+       int j = cinfo->output_scanline-y0;
+       jpeg_read_scanlines( cinfo, buffer, 1 );
+       if (dec->data) memcpy(dec->data + (size_t)(x1-x0)*c*j, buffer[0]+dx, (size_t)(x1-x0)*c);
+       else letterbox_row(lb, buffer[0]+dx, j);
+    }
+    if (cinfo->output_scanline < cinfo->output_height) jpeg_abort_decompress( cinfo ); // rest not wanted
+    else jpeg_finish_decompress( cinfo );
+    if (dec->data) {
+       int res = letterbox_image_rgb(lb, dec->data);
+       pool_put((char*)dec->data);
+       dec->data = NULL;
+       return res;
+    }
+    return 0;
+}
+#else
+typedef struct JpegDecoder JpegDecoder; // stb has no state to keep
+JpegDecoder* jpeg_decoder_new(void) { return NULL; }
+#endif
+
+int load_image_mem(JpegDecoder *dec, unsigned char *buff, int len, int rotation, int net_w, int net_h,
+                   float *out, Letterbox *lb, float *scale, Roi *roi) {
+    // try to decode contents of buff as jpeg image and letterbox it into out, a net_w by net_h network input.
+    // scale is set to scaling applied by the decoder, roi to the region decoded
+
+#ifdef LIBJPEG
+    // decode jpeg and scale to fit within net_w by net_h box after rotation applied
+    return libjpg_load_from_memory(dec, buff, len, rotation, net_w, net_h, out, lb, scale, roi);
+#else
+    int w, h, c;
+    unsigned char *rgb_data = stbi_load_from_memory(buff, len, &w, &h, &c, 3);
+    if (!rgb_data) {
+        ERR("Cannot load image, STB Reason: %s\n", stbi_failure_reason());
+        return -1;
+    }
+    *scale=1.0;
+    roi->x = roi->y = 0; roi->w = roi->img_w = w; roi->h = roi->img_h = h; // no cropping, whole image decoded
+    letterbox_start(lb, out, net_w, net_h, w, h, 3, rotation);
+    int res = letterbox_image_rgb(lb, rgb_data);
+    free(rgb_data);
+    return res;
+#endif
+}
+
+void display_detections(detection *dets, int num, float thresh, char **names, int classes) {
+    // print classification output
+    int i,j;
+    if (!verbose) return;
+    for(i = 0; i < num; ++i){
+        for(j = 0; j < classes; ++j){
+            if (dets[i].prob[j] > thresh){
+                printf("%s: %.0f%%\n", names[j], dets[i].prob[j]*100);
+            }
+        }
+    }
+}
+
+void stage_queue_init(StageQueue *q, int capacity) {
+  size_t size=1, i;
+  while (size < capacity) size*=2;
+  q->cells = calloc(size, sizeof(QueueCell));
+  for (i=0; i<size; i++) q->cells[i].seq = i;
+  q->mask = size-1;
+  q->enq_pos = q->deq_pos = 0;
+  sem_init(&q->items, 0, 0);
+  sem_init(&q->slots, 0, capacity);
+}
+
+void stage_push(StageQueue *q, void *data) {
+  // add to queue, waiting for room if it's full
+  while (sem_wait(&q->slots)<0 && errno==EINTR);
+  QueueCell *cell;
+  size_t pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+  while (1) {
+    cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif==0) {
+      if (__atomic_compare_exchange_n(&q->enq_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else { // another producer got here first, or a consumer is still reading the cell
+      pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->data = data;
+  __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+  sem_post(&q->items);
+}
+
+void* stage_pop(StageQueue *q, struct timespec *deadline) {
+  // take from queue, waiting until there's something there or deadline (if not NULL) passes.
+  // returns NULL on timeout
+  int res;
+  do {
+    res = deadline ? sem_timedwait(&q->items, deadline) : sem_wait(&q->items);
+  } while (res<0 && errno==EINTR);
+  if (res<0) return NULL;
+  QueueCell *cell;
+  size_t pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+  while (1) {
+    cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+    if (dif==0) {
+      if (__atomic_compare_exchange_n(&q->deq_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else { // another consumer got here first, or the producer is still writing the cell
+      pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+    }
+  }
+  void *data = cell->data;
+  __atomic_store_n(&cell->seq, pos+q->mask+1, __ATOMIC_RELEASE);
+  sem_post(&q->slots);
+  return data;
+}
+
+int stage_queue_depth(StageQueue *q) {
+  int n=0;
+  sem_getvalue(&q->items, &n);
+  return n;
+}
+
+void finish_request(Request *r);
+
+void drop_requests(Request *r) {
+   // answer a list of requests that won't be processed
+   while (r) {
+      Request *next = r->next;
+      DEBUG_HTTP("dropping request from client %llx\n", (unsigned long long)r->client);
+      pool_put(r->post_data); r->post_data=NULL;
+      r->response = NULL;
+      r->status = 503;
+      finish_request(r);
+      r = next;
+   }
+}
+
+void submit_request(Request *r) {
+   // add request to queue and wake up a worker.  if the client already has a request waiting, this newer
+   // one takes its place in line and the old one is dropped.  if the queue is full the oldest is dropped
+   Request *dropped=NULL;
+   r->done=0; r->next=NULL;
+   if (!r->model) r->model = &models[0];
+   r->size = model_size(r->model, r->d);
+   r->t_received = now_us();
+   __sync_fetch_and_add(&metrics.bytes_in, r->len);
+   int ms = r->deadline_ms ? r->deadline_ms : default_deadline;
+   r->deadline = ms>0 ? r->t_received+ms*1000L : 0;
+   if (!r->client) {
+      r->client = r->conn ? (uint64_t)(uintptr_t)r->conn
+                          : (1ULL<<62) | ((uint64_t)r->udp_addr.sin_addr.s_addr<<16) | r->udp_addr.sin_port;
+   }
+   pthread_mutex_lock(&request_queue.mutex);
+   Request *q, *prev=NULL;
+   for (q=request_queue.head; q && !r->keep_all; prev=q, q=q->next) {
+      if (q->client==r->client && !q->keep_all) break;
+   }
+   if (q) { // replace
+      r->next = q->next;
+      if (prev) prev->next=r; else request_queue.head=r;
+      if (request_queue.tail==q) request_queue.tail=r;
+      q->next = dropped; dropped = q;
+      stats.replaced++;
+   } else {
+      if (request_queue.depth >= max_queue) {
+         Request *oldest = request_queue.head;
+         request_queue.head = oldest->next;
+         if (request_queue.head==NULL) request_queue.tail=NULL;
+         request_queue.depth--;
+         oldest->next = dropped; dropped = oldest;
+         stats.overflowed++;
+      }
+      if (request_queue.tail) request_queue.tail->next=r; else request_queue.head=r;
+      request_queue.tail=r;
+      request_queue.depth++;
+   }
+   stats.admitted++;
+   DEBUG_HTTP("queued request, queue depth %d\n", request_queue.depth);
+   pthread_cond_signal(&request_queue.cond);
+   pthread_mutex_unlock(&request_queue.mutex);
+   drop_requests(dropped);
+}
+
+Request* next_request() {
+   // take request from head of queue, waiting until one is available.  requests that have missed their
+   // deadline are dropped on the way
+   Request *r, *expired=NULL;
+   pthread_mutex_lock(&request_queue.mutex);
+   while (1) {
+      if (request_queue.head==NULL && expired) { // answer them now, rather than after a wait
+         pthread_mutex_unlock(&request_queue.mutex);
+         drop_requests(expired);
+         expired=NULL;
+         pthread_mutex_lock(&request_queue.mutex);
+         continue;
+      }
+      while (request_queue.head==NULL) {
+         pthread_cond_wait(&request_queue.cond, &request_queue.mutex);
+      }
+      r = request_queue.head;
+      request_queue.head = r->next;
+      if (request_queue.head==NULL) request_queue.tail=NULL;
+      request_queue.depth--;
+      if (r->deadline==0 || now_us() <= r->deadline) break;
+      r->next = expired; expired = r;
+      stats.expired++;
+   }
+   pthread_mutex_unlock(&request_queue.mutex);
+   drop_requests(expired);
+   return r;
+}
+
+void io_request_done(Request *r);
+void udp_request_done(Request *r);
+
+void stats_json(char *json, int size) {
+   // write out stats as json
+   int i, n;
+   n = snprintf(json, size, "{\"process\": %d, \"processes\": %d, \"workers\": %d, \"batch_size\": %d, \"batch_window_ms\": %.1f, "
+                "\"request_queue\": {\"depth\": %d, \"max\": %d, \"deadline_ms\": %d, \"admitted\": %ld, \"replaced\": %ld, \"expired\": %ld, \"overflowed\": %ld}, "
+                "\"frame_cache\": {\"threshold\": %.1f, \"hits\": %ld, \"misses\": %ld}, "
+                "\"tracking\": {\"tracked\": %ld, \"keyframes\": %ld}, \"cascade\": {\"crops\": %ld}, "
+                "\"batches\": [",
+                proc_index, num_procs, num_workers, batch_size, batch_window/1000.0,
+                request_queue.depth, max_queue, default_deadline, stats.admitted, stats.replaced, stats.expired, stats.overflowed,
+                repeat_threshold, stats.repeats, stats.misses, stats.tracked, stats.keyframes, stats.crops);
+   for (i=1; i<=batch_size && n<size; i++) {
+      n += snprintf(json+n, size-n, "%s%ld", i>1 ? ", " : "", stats.batches[i]);
+   }
+   // for each stage, how many requests are waiting for it and what fraction of its threads' time is spent busy
+   int threads[NUM_STAGES] = {num_decoders, num_workers, num_posters};
+   int depth[NUM_STAGES] = {request_queue.depth, stage_queue_depth(&infer_queue), stage_queue_depth(&post_queue)};
+   double uptime = now_us()-stats.start_time+1;
+   if (n<size) n += snprintf(json+n, size-n, "], \"stages\": {");
+   for (i=0; i<NUM_STAGES && n<size; i++) {
+      n += snprintf(json+n, size-n, "%s\"%s\": {\"threads\": %d, \"queue_depth\": %d, \"utilization\": %.3f}",
+                    i ? ", " : "", stage_names[i], threads[i], depth[i], stats.busy[i]/(uptime*threads[i]));
+   }
+   // models, and which are loaded
+   pthread_mutex_lock(&models_mutex);
+   if (n<size) n += snprintf(json+n, size-n, "}, \"memory\": {\"used_mb\": %.1f, \"budget_mb\": %.1f}, \"models\": [",
+                             memory_used/1048576.0, memory_budget/1048576.0);
+   for (i=0; i<num_models && n<size; i++) {
+      Model *m = &models[i];
+      int j;
+      n += snprintf(json+n, size-n, "%s{\"name\": \"%s\", \"type\": \"%s\", \"sizes\": [",
+                    i ? ", " : "", m->name, m->detector ? "detector" : "classifier");
+      for (j=0; j<m->num_sizes && n<size; j++) n += snprintf(json+n, size-n, "%s%d", j ? ", " : "", m->w[j]);
+      if (n<size) n += snprintf(json+n, size-n, "], \"loaded\": %s, \"memory_mb\": %.1f, \"requests\": %ld, \"loads\": %ld, "
+                                "\"evictions\": %ld, \"reloads\": %ld}", m->loaded ? "true" : "false",
+                                m->loaded ? m->loaded->bytes/1048576.0 : 0.0, m->requests, m->loads, m->evictions, m->reloads);
+   }
+   pthread_mutex_unlock(&models_mutex);
+   if (n<size) snprintf(json+n, size-n, "]}");
+}
+
+int hist_bucket(long us) {
+  // which bucket value goes in
+  if (us<0) us=0;
+  int shift = 63-__builtin_clzl(us|1)-HIST_SUB_BITS;
+  if (shift<0) shift=0;
+  int b = shift*HIST_SUB + (int)(us>>shift);
+  return b<HIST_BUCKETS ? b : HIST_BUCKETS-1;
+}
+
+long hist_value(int b) {
+  // middle of range of values in bucket b
+  if (b < 2*HIST_SUB) return b;
+  int shift = b/HIST_SUB-1;
+  return ((long)(b-shift*HIST_SUB)<<shift) + (1L<<(shift-1));
+}
+
+void hist_record(Histogram *h, long us) {
+  __sync_fetch_and_add(&h->buckets[hist_bucket(us)], 1);
+  __sync_fetch_and_add(&h->count, 1);
+  __sync_fetch_and_add(&h->sum, us);
+  long max = h->max;
+  while (us > max && !__sync_bool_compare_and_swap(&h->max, max, us)) max = h->max;
+}
+
+void record_timing(int t, long start, long end) {
+  if (start && end) hist_record(&metrics.timings[t], end-start);
+}
+
+void hist_percentiles(Histogram *h, const double *p, long *values, int n) {
+  // values (us) at percentiles p[0..n-1], which are in increasing order
+  long total=0, seen=0;
+  int b, i=0;
+  for (b=0; b<HIST_BUCKETS; b++) total += h->buckets[b]; // may have moved on from h->count
+  for (b=0; b<HIST_BUCKETS && i<n; b++) {
+    seen += h->buckets[b];
+    while (i<n && seen>0 && seen >= p[i]/100*total) values[i++] = hist_value(b);
+  }
+  while (i<n) values[i++] = 0;
+  for (i=0; i<n; i++) if (values[i] > h->max) values[i] = h->max; // bucket's middle can be past largest value
+}
+
+void metrics_json(char *json, int size) {
+   // write out latency percentiles (ms) and throughput counters as json
+   static const double pcts[] = {50, 90, 99, 99.9};
+   int i, n;
+   double uptime = (now_us()-stats.start_time)/1e6;
+   n = snprintf(json, size, "{\"uptime_s\": %.1f, \"requests\": {\"completed\": %ld, \"failed\": %ld, \"per_second\": %.2f, "
+                "\"bytes_in\": %ld, \"bytes_out\": %ld}, \"latency_ms\": {",
+                uptime, metrics.completed, metrics.failed, metrics.completed/(uptime>0 ? uptime : 1),
+                metrics.bytes_in, metrics.bytes_out);
+   for (i=0; i<NUM_TIMINGS && n<size; i++) {
+      Histogram *h = &metrics.timings[i];
+      long v[4];
+      hist_percentiles(h, pcts, v, 4);
+      n += snprintf(json+n, size-n, "%s\"%s\": {\"count\": %ld, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+                    i ? ", " : "", timing_names[i], h->count, h->count ? h->sum/1000.0/h->count : 0.0,
+                    v[0]/1000.0, v[1]/1000.0, v[2]/1000.0, v[3]/1000.0, h->max/1000.0);
+   }
+   if (n<size) snprintf(json+n, size-n, "}}");
+}
+
+void response_sent(long starttime, long t_done, int status, int len) {
+  // response to a request that started at starttime and was ready at t_done (0 if it never got that far) has gone out
+  if (starttime==0) return; // not a detection request
+  long t_sent = now_us();
+  __sync_fetch_and_add(status==200 && t_done ? &metrics.completed : &metrics.failed, 1);
+  __sync_fetch_and_add(&metrics.bytes_out, len);
+  record_timing(T_SEND, t_done, t_sent);
+  if (t_done) record_timing(T_TOTAL, starttime, t_sent);
+}
+
+void finish_request(Request *r) {
+   // pass the response on to whoever sends it
+   if (r->conn) { // hand back to the TCP connection's I/O thread
+      io_request_done(r);
+   } else { // UDP, worker sends it
+      udp_request_done(r);
+   }
+}
+
+void release_image(Request *r) {
+  // done with the request's network input
+  pool_put((char*)r->im.data);
+  r->im.data = NULL;
+}
+
+int decode_request(int id, JpegDecoder *dec, Request *r) {
+  // decode image and convert it to the network's input format.  returns -1 on error
+  char *post_data = r->post_data;
+  int len = r->len, rotation = r->rotation, isYUV = r->isYUV;
+  int w = r->w, h = r->h, c = 3;
+  int net_w = r->model->w[r->size], net_h = r->model->h[r->size];
+  r->response = NULL; r->response_len = 0;
+
+  // decode image straight into the network input
+  r->t_decode = NOW;
+  float scale=1.0;
+  float *out = (float*)pool_get((size_t)net_w*net_h*3*sizeof(float));
+  Letterbox lb;
+  if (!out) return -1;
+  if (!isYUV) { // parse JPEG
+    if (load_image_mem(dec,(unsigned char*)post_data,(int)len,rotation,net_w,net_h,out,&lb,&scale,&r->roi)<0){
+      pool_put((char*)out);
+      return -1;
+    }
+    r->t_rot = NOW; // letterboxed as it was decoded
+  } else {
+     // convert YUV straight into the network input, scaled to fit
+     if (yuv_size(isYUV, w, h) != len) {
+        WARN("POST YUV data len %d does not match supplied image size w=%d, h=%d, format %s\n",len,w,h,
+             isYUV>0 && isYUV<=YUV_YUYV ? yuv_names[isYUV] : "unknown");
+        pool_put((char*)out);
+        return -1;
+     }
+     int dst_w=w, dst_h=h;
+     if ((rotation%180==90) || (rotation%180==-90)) {
+        dst_w=h; dst_h = w;
+     }
+     scale = fminf(net_w*1.0/dst_w, net_h*1.0/dst_h);
+     if (scale>1.0) scale=1.0;
+     int out_w = w*scale, out_h = h*scale;
+     if (out_w<1) out_w = 1;
+     if (out_h<1) out_h = 1;
+     letterbox_start(&lb, out, net_w, net_h, out_w, out_h, c, rotation);
+     if (letterbox_yuv(&lb, (unsigned char*)post_data, isYUV, w, h)<0) {
+        pool_put((char*)out);
+        return -1;
+     }
+     r->t_rot = NOW; // letterboxed as it was converted
+     r->roi.x = r->roi.y = 0; r->roi.w = r->roi.img_w = w; r->roi.h = r->roi.img_h = h; // no cropping
+  };
+  // done with the encoded image, recycle its buffer now rather than when the response goes out
+  pool_put(r->post_data); r->post_data=NULL;
+  DEBUG_JPG("decoder %d: w=%d, h=%d, net_w=%d, net_h=%d\n", id, lb.w, lb.h, net_w, net_h);
+
+  r->im.w = net_w; r->im.h = net_h; r->im.c = 3; r->im.data = out;
+  r->pad_w = lb.pad_w; r->pad_h = lb.pad_h;
+  r->scale = scale*lb.scale;
+  Roi *roi = &r->roi; // where the region decoded is in the rotated image
+  switch (lb.rotation) {
+    case 90: r->off_x = roi->img_h-roi->y-roi->h; r->off_y = roi->x; break;
+    case 180: r->off_x = roi->img_w-roi->x-roi->w; r->off_y = roi->img_h-roi->y-roi->h; break;
+    case 270: r->off_x = roi->y; r->off_y = roi->img_w-roi->x-roi->w; break;
+    default: r->off_x = roi->x; r->off_y = roi->y;
+  }
+  r->t_ready = NOW;
+  record_timing(T_RECEIVE, r->starttime, r->t_received);
+  record_timing(T_QUEUE, r->t_received, r->t_decode);
+  record_timing(T_DECODE, r->t_decode, r->t_rot);
+  record_timing(T_ROTATE, r->t_rot, r->t_ready);
+  return 0;
+}
+
+// Frame cache.  Phones stream frames that are often much the same as the one before, so for each client we
+// keep a thumbnail of the last frame that went through the network along with its detections.  A new frame
+// whose thumbnail is within repeat_threshold of it gets those detections back without running the network.
+// The thumbnail isn't updated on a hit, so a slowly changing scene can't drift away from what was detected.
+#define CACHE_ENTRIES 256 // clients remembered, direct mapped so a client can be pushed out by another
+#define CACHE_MAX_AGE 2000000 // us a frame's detections can be reused for
+
+typedef struct CacheEntry {
+  uint64_t client;
+  Model *model, *cascade; // detections are only reused for the same models
+  long time; // when frame was processed
+  float scale; // frames must be the same size, rotation and crop
+  int pad_w, pad_h, off_x, off_y;
+  unsigned char thumb[THUMB_SIZE*THUMB_SIZE];
+  Box *boxes;
+  int num_boxes;
+} CacheEntry;
+
+CacheEntry frame_cache[CACHE_ENTRIES];
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void frame_thumb(image im, unsigned char *thumb) {
+  // average luma of each block of (letterboxed, planar RGB) image, sampling every other pixel
+  int bx, by, x, y;
+  int bw = im.w/THUMB_SIZE, bh = im.h/THUMB_SIZE;
+  float *R = im.data, *G = R+im.w*im.h, *B = G+im.w*im.h;
+  for (by=0; by<THUMB_SIZE; by++) {
+    for (bx=0; bx<THUMB_SIZE; bx++) {
+      float sum=0;
+      int n=0;
+      for (y=by*bh; y<(by+1)*bh; y+=2) {
+        int i = y*im.w + bx*bw;
+        for (x=0; x<bw; x+=2, n++) sum += .299f*R[i+x] + .587f*G[i+x] + .114f*B[i+x];
+      }
+      thumb[by*THUMB_SIZE+bx] = n ? (unsigned char)(sum*255/n + .5f) : 0;
+    }
+  }
+}
+
+int client_slot(uint64_t client) {
+  // spread clients over CACHE_ENTRIES slots
+  return (client*0x9E3779B97F4A7C15ULL) >> 56; // 256 entries
+}
+
+CacheEntry *cache_entry(uint64_t client) {
+  return &frame_cache[client_slot(client)];
+}
+
+int cache_lookup(Request *r) {
+  // is the request's frame a repeat of its client's last one?  if so, copy its detections.  returns 1 if so
+  int i, diff=0, hit=0;
+  frame_thumb(r->im, r->thumb);
+  pthread_mutex_lock(&cache_mutex);
+  CacheEntry *e = cache_entry(r->client);
+  if (e->client==r->client && e->model==r->model && e->cascade==r->cascade && e->time && r->t_ready-e->time < CACHE_MAX_AGE &&
+      e->scale==r->scale && e->pad_w==r->pad_w && e->pad_h==r->pad_h && e->off_x==r->off_x && e->off_y==r->off_y) {
+    for (i=0; i<THUMB_SIZE*THUMB_SIZE; i++) diff += abs(e->thumb[i]-r->thumb[i]);
+    if (diff <= repeat_threshold*THUMB_SIZE*THUMB_SIZE) {
+      hit = 1;
+      r->num_boxes = e->num_boxes;
+      r->boxes = malloc(e->num_boxes*sizeof(Box)+1);
+      memcpy(r->boxes, e->boxes, e->num_boxes*sizeof(Box));
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  __sync_fetch_and_add(hit ? &stats.repeats : &stats.misses, 1);
+  DEBUG_TIME("client %llx: frame differs by %.1f, %s\n", (unsigned long long)r->client,
+             (float)diff/(THUMB_SIZE*THUMB_SIZE), hit ? "reusing detections" : "processing");
+  return hit;
+}
+
+void cache_store(Request *r) {
+  // remember the request's frame and detections (takes r->boxes) as its client's last processed frame
+  pthread_mutex_lock(&cache_mutex);
+  CacheEntry *e = cache_entry(r->client);
+  Box *old = e->boxes;
+  e->client = r->client;
+  e->model = r->model;
+  e->cascade = r->cascade;
+  e->time = r->t_ready;
+  e->scale = r->scale; e->pad_w = r->pad_w; e->pad_h = r->pad_h; e->off_x = r->off_x; e->off_y = r->off_y;
+  memcpy(e->thumb, r->thumb, sizeof(e->thumb));
+  e->boxes = r->boxes; e->num_boxes = r->num_boxes;
+  pthread_mutex_unlock(&cache_mutex);
+  free(old);
+  r->boxes = NULL; r->num_boxes = 0;
+}
+
+// Tracking mode.  A client asking for track=K gets every Kth frame (a keyframe) run through the network, and
+// the boxes found are then followed across the frames in between: each box's position is predicted from its
+// velocity and the best match for its contents in the previous frame is searched for around there.  If any
+// box can't be found (its best match differs by more than track_diff) the frame goes to the network after
+// all.  Velocities are smoothed with an alpha-beta filter (a fixed-gain Kalman filter), and carried over
+// keyframes by matching new boxes to the old ones by IoU.  Tracking works on the luma of the network input
+// (letterboxed) image, so boxes are kept in those coordinates and converted for the response.
+#define MAX_TRACKS 64 // most boxes tracked per client
+#define TRACK_GRID 8 // a box is compared on TRACK_GRID x TRACK_GRID samples across it
+#define TRACK_SEARCH 4 // positions tried either side of the prediction, in x and y
+#define DEFAULT_TRACK_DIFF 24 // default for track_diff
+#define TRACK_MAX_AGE 2000000 // us without a frame before a client's tracks are forgotten
+#define TRACK_ALPHA 0.85f // gains of alpha-beta filter, for position and velocity
+#define TRACK_BETA 0.5f
+#define TRACK_IOU 0.3f // min overlap for a new detection to continue an old track
+
+typedef struct Track {
+  Box box; // as sent to client
+  float x, y, w, h; // centre and size in network input image
+  float vx, vy; // velocity, pixels per frame
+} Track;
+
+typedef struct TrackState {
+  uint64_t client;
+  Model *model, *cascade;
+  long time; // of last frame
+  int frames; // since keyframe
+  float scale; // frames must be the same size, rotation and crop
+  int pad_w, pad_h, off_x, off_y;
+  unsigned char *ref; // luma of last frame
+  Track tracks[MAX_TRACKS];
+  int num_tracks;
+} TrackState;
+
+TrackState track_states[CACHE_ENTRIES];
+pthread_mutex_t track_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned char *frame_luma(image im) {
+  // luma of (planar RGB) image
+  int i, n = im.w*im.h;
+  unsigned char *luma = malloc(n);
+  float *R = im.data, *G = R+n, *B = G+n;
+  for (i=0; i<n; i++) luma[i] = (unsigned char)((.299f*R[i] + .587f*G[i] + .114f*B[i])*255 + .5f);
+  return luma;
+}
+
+int track_diff(const unsigned char *ref, const unsigned char *cur, int w, int h, Track *t, float x, float y) {
+  // mean difference between box t in ref and the same size box centred on (x,y) in cur
+  int i, j, sum=0;
+  for (j=0; j<TRACK_GRID; j++) {
+    float fy = (j+.5f)/TRACK_GRID - .5f;
+    int ry = t->y + fy*t->h, cy = y + fy*t->h;
+    ry = ry<0 ? 0 : ry>=h ? h-1 : ry;
+    cy = cy<0 ? 0 : cy>=h ? h-1 : cy;
+    for (i=0; i<TRACK_GRID; i++) {
+      float fx = (i+.5f)/TRACK_GRID - .5f;
+      int rx = t->x + fx*t->w, cx = x + fx*t->w;
+      rx = rx<0 ? 0 : rx>=w ? w-1 : rx;
+      cx = cx<0 ? 0 : cx>=w ? w-1 : cx;
+      sum += abs(ref[ry*w+rx] - cur[cy*w+cx]);
+    }
+  }
+  return sum/(TRACK_GRID*TRACK_GRID);
+}
+
+void track_to_box(Request *r, Track *t) {
+  // convert tracked position back to original image coordinates for the response
+  t->box.x = (t->x-r->pad_w)/r->scale;
+  t->box.y = (t->y-r->pad_h)/r->scale;
+}
+
+int track_frame(Request *r) {
+  // try to follow the client's boxes into this frame.  returns 1 if that worked and r->boxes is filled in,
+  // 0 if frame needs to go through the network
+  int i, dx, dy, w = r->im.w, h = r->im.h;
+  int max_diff = r->track_diff ? r->track_diff : DEFAULT_TRACK_DIFF;
+  Track moved[MAX_TRACKS];
+  r->luma = frame_luma(r->im);
+  pthread_mutex_lock(&track_mutex);
+  TrackState *s = &track_states[client_slot(r->client)];
+  if (s->client!=r->client || s->model!=r->model || s->cascade!=r->cascade || s->ref==NULL || r->t_ready-s->time > TRACK_MAX_AGE || s->frames+1 >= r->track_k ||
+      s->scale!=r->scale || s->pad_w!=r->pad_w || s->pad_h!=r->pad_h || s->off_x!=r->off_x || s->off_y!=r->off_y) {
+    pthread_mutex_unlock(&track_mutex);
+    return 0; // time for a keyframe
+  }
+  for (i=0; i<s->num_tracks; i++) {
+    Track *t = &s->tracks[i];
+    float px = t->x+t->vx, py = t->y+t->vy; // prediction
+    float step = (t->w<t->h ? t->w : t->h)/(2*TRACK_GRID);
+    if (step<1) step=1;
+    int best = INT_MAX;
+    float bx=px, by=py;
+    for (dy=-TRACK_SEARCH; dy<=TRACK_SEARCH; dy++) {
+      for (dx=-TRACK_SEARCH; dx<=TRACK_SEARCH; dx++) {
+        int d = track_diff(s->ref, r->luma, w, h, t, px+dx*step, py+dy*step);
+        if (d<best) { best=d; bx=px+dx*step; by=py+dy*step; }
+      }
+    }
+    // then home in on it
+    for (step/=2; step>=1; step/=2) {
+      float cx=bx, cy=by;
+      for (dy=-1; dy<=1; dy++) {
+        for (dx=-1; dx<=1; dx++) {
+          int d = (dx||dy) ? track_diff(s->ref, r->luma, w, h, t, cx+dx*step, cy+dy*step) : best;
+          if (d<best) { best=d; bx=cx+dx*step; by=cy+dy*step; }
+        }
+      }
+    }
+    if (best > max_diff) {
+      DEBUG_TIME("client %llx: lost %s (difference %d), running network\n", (unsigned long long)r->client,
+                 r->model->names[t->box.cls], best);
+      pthread_mutex_unlock(&track_mutex);
+      return 0;
+    }
+    moved[i] = *t;
+    moved[i].x = px + TRACK_ALPHA*(bx-px);
+    moved[i].y = py + TRACK_ALPHA*(by-py);
+    moved[i].vx += TRACK_BETA*(bx-px);
+    moved[i].vy += TRACK_BETA*(by-py);
+    track_to_box(r, &moved[i]);
+  }
+  // found them all
+  memcpy(s->tracks, moved, s->num_tracks*sizeof(Track));
+  r->num_boxes = s->num_tracks;
+  r->boxes = malloc(s->num_tracks*sizeof(Box)+1);
+  for (i=0; i<s->num_tracks; i++) r->boxes[i] = s->tracks[i].box;
+  unsigned char *old = s->ref;
+  s->ref = r->luma; r->luma = NULL;
+  s->time = r->t_ready;
+  s->frames++;
+  pthread_mutex_unlock(&track_mutex);
+  free(old);
+  return 1;
+}
+
+float track_iou(Track *a, Track *b) {
+  float w = fminf(a->x+a->w/2, b->x+b->w/2) - fmaxf(a->x-a->w/2, b->x-b->w/2);
+  float h = fminf(a->y+a->h/2, b->y+b->h/2) - fmaxf(a->y-a->h/2, b->y-b->h/2);
+  if (w<=0 || h<=0) return 0;
+  return w*h/(a->w*a->h + b->w*b->h - w*h);
+}
+
+int box_cmp(const void *a, const void *b) {
+  // for sorting most confident first
+  float pa = ((Box*)a)->prob, pb = ((Box*)b)->prob;
+  return pa<pb ? 1 : pa>pb ? -1 : 0;
+}
+
+void track_keyframe(Request *r) {
+  // start tracking the boxes the network found in this frame (takes r->luma)
+  int i, j, n=0;
+  Track fresh[MAX_TRACKS];
+  Box *boxes = r->boxes;
+  if (r->num_boxes > MAX_TRACKS) { // keep the most confident
+    boxes = malloc(r->num_boxes*sizeof(Box));
+    memcpy(boxes, r->boxes, r->num_boxes*sizeof(Box));
+    qsort(boxes, r->num_boxes, sizeof(Box), box_cmp);
+  }
+  pthread_mutex_lock(&track_mutex);
+  TrackState *s = &track_states[client_slot(r->client)];
+  int same = s->client==r->client && s->model==r->model && s->scale==r->scale && s->pad_w==r->pad_w && s->pad_h==r->pad_h &&
+             s->off_x==r->off_x && s->off_y==r->off_y;
+  for (i=0; i<r->num_boxes && n<MAX_TRACKS; i++) {
+    Track *t = &fresh[n];
+    t->box = boxes[i];
+    t->x = t->box.x*r->scale + r->pad_w; t->y = t->box.y*r->scale + r->pad_h;
+    t->w = t->box.w*r->scale; t->h = t->box.h*r->scale;
+    if (!(t->w >= 1 && t->h >= 1 && t->w <= 2*r->model->w[r->size] && t->h <= 2*r->model->h[r->size])) continue; // nothing sensible to track
+    n++;
+    t->vx = t->vy = 0;
+    // carry on velocity of the old track this best overlaps (where it should be by now)
+    float best = TRACK_IOU;
+    for (j=0; same && j<s->num_tracks; j++) {
+      Track old = s->tracks[j];
+      if (old.box.cls != t->box.cls) continue;
+      old.x += old.vx; old.y += old.vy;
+      float iou = track_iou(&old, t);
+      if (iou > best) {
+        best = iou;
+        t->vx = old.vx + TRACK_BETA*(t->x-old.x);
+        t->vy = old.vy + TRACK_BETA*(t->y-old.y);
+      }
+    }
+  }
+  memcpy(s->tracks, fresh, n*sizeof(Track));
+  s->num_tracks = n;
+  s->client = r->client;
+  s->model = r->model;
+  s->cascade = r->cascade;
+  s->scale = r->scale; s->pad_w = r->pad_w; s->pad_h = r->pad_h; s->off_x = r->off_x; s->off_y = r->off_y;
+  unsigned char *old = s->ref;
+  s->ref = r->luma; r->luma = NULL;
+  s->time = r->t_ready;
+  s->frames = 0;
+  pthread_mutex_unlock(&track_mutex);
+  free(old);
+  if (boxes != r->boxes) free(boxes);
+}
+
+// Responses are written straight into a pool buffer, in one pass, which then goes with the request to be
+// sent and back to the pool afterwards.
+typedef struct Writer {
+  char *buf; // NULL if we ran out of memory
+  size_t len, size;
+} Writer;
+
+int writer_reserve(Writer *w, size_t n) {
+  // make room for another n bytes
+  if (w->len+n <= w->size) return 0;
+  if (w->buf) w->buf = pool_grow(w->buf, w->len, w->len+n);
+  w->size = pool_size(w->buf);
+  return w->buf ? 0 : -1;
+}
+
+void writer_put(Writer *w, const void *data, size_t n) {
+  if (writer_reserve(w, n)) return;
+  memcpy(w->buf+w->len, data, n);
+  w->len += n;
+}
+
+void writer_printf(Writer *w, const char *fmt, ...) {
+  va_list ap;
+  while (w->buf) {
+    va_start(ap, fmt);
+    int n = vsnprintf(w->buf+w->len, w->size-w->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (w->len+n < w->size) { w->len += n; return; }
+    if (writer_reserve(w, n+1)) return;
+  }
+}
+
+void write_box(Writer *out, Request *r, Box *b, int i) {
+  // add i'th detection to response
+  int x=b->x+r->off_x, y=b->y+r->off_y, w=b->w, h=b->h;
+  char **names = r->model->names;
+  if (i && r->out_format!=OUT_BINARY) writer_put(out,",",1);
+  switch (r->out_format) {
+  case 0: // victor's jsonpickle format ...
+     writer_printf(out,"{\"py/tuple\": [\"%s\", %f, {\"py/tuple\": [%d,%d,%d,%d]}] }",
+                   names[b->cls],b->prob,x,y,w,h);
+     break;
+  case 1: // darragh's android json format ...
+     writer_printf(out,"{\"topleft\": {\"y\": %d, \"x\": %d}, \"confidence\": %f, \"bottomRight\": {\"y\": %d, \"x\": %d}, \"label\": \"%s\"}",y-h/2,x-w/2,b->prob,y+h/2,x+w/2,names[b->cls]);
+     break;
+  case OUT_BINARY: {
+     DetectionRecord rec = {b->cls, b->sub+1, b->prob, x, y, w, h};
+     writer_put(out, &rec, sizeof(rec));
+     break;
+  }
+  default: // new improved JSON format
+     writer_printf(out,"{\"title\": \"%s\", \"confidence\": %f, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d",
+                   names[b->cls],b->prob,x,y,w,h);
+     if (b->sub>=0) // what the cascade classifier made of it
+        writer_printf(out,", \"class\": {\"title\": \"%s\", \"confidence\": %f}", r->cascade->names[b->sub], b->sub_prob);
+     writer_put(out,"}",1);
+  }
+}
+
+void make_boxes(Request *r, float thresh) {
+  // do NMS on the detections and keep those over thresh as r->boxes, in original image coordinates
+  detection *dets = r->dets;
+  int i, j, size=0, nboxes = r->nboxes;
+  float scale = r->scale;
+  int pad_w = r->pad_w, pad_h = r->pad_h;
+  int classes = nboxes>0 ? dets[0].classes : 0;
+  if (nboxes>0) {
+    float nms=.45;
+    do_nms_sort(dets, nboxes, classes, nms);
+    //display_detections(dets, nboxes, thresh, names, classes);
+  }
+  for(i = 0; i < nboxes; ++i){
+    for(j = 0; j < classes; ++j){
+      if (dets[i].prob[j] > thresh){
+        Box b;
+        b.cls = j;
+        b.prob = dets[i].prob[j];
+        b.x=(int)(dets[i].bbox.x-pad_w)/scale;
+        b.y=(int)(dets[i].bbox.y-pad_h)/scale;
+        b.w=(int)dets[i].bbox.w/scale;
+        b.h=(int)dets[i].bbox.h/scale;
+        b.sub = -1; b.sub_prob = 0;
+        if (r->num_boxes==size) {
+          size = size ? 2*size : 16;
+          r->boxes = realloc(r->boxes, size*sizeof(Box));
+        }
+        r->boxes[r->num_boxes++] = b;
+      }
+    }
+  }
+  free_detections(r->dets, r->nboxes);
+  r->dets = NULL;
+  r->nboxes = 0;
+}
+
+void build_response(Request *r, float thresh) {
+  // do NMS on the detections (unless that's been done already) and build the json (or binary) response to send
+  // back to client
+  int out_format = r->out_format;
+  if (r->dets) make_boxes(r, thresh);
+  r->t_json = NOW;
+
+  Writer out;
+  out.buf = pool_get(BUFFER_SIZE); out.len = 0; out.size = pool_size(out.buf);
+  if (out_format>1 && out_format!=OUT_BINARY) // new format
+     writer_printf(&out,"{\"results\": [");
+  else if (out_format<=1)
+     writer_printf(&out,"[");
+
+  int i;
+  for (i=0; i<r->num_boxes; i++) write_box(&out, r, &r->boxes[i], i);
+  if (!r->cached) { // keep what the network found for the tracker or frame cache
+    if (r->track_k) track_keyframe(r);
+    if (repeat_threshold>0) cache_store(r);
+  }
+  if (out_format!=OUT_BINARY) {
+    writer_printf(&out,"], \"server_timings\": {\"size\": %d, \"r\": %.1f, \"jpg\": %.1f, \"rot\": %.1f, \"yolo\": %.1f, \"json\": %.1f, \"tot\": %.1f}",
+               r->len, 
+               TOCK(r->t_decode,r->starttime)*1000,
+               TOCK(r->t_rot,r->t_decode)*1000,
+               TOCK(r->t_yolo,r->t_rot)*1000,
+               TOCK(r->t_post,r->t_yolo)*1000, 
+               TOCK(NOW,r->t_post)*1000,
+               TOCK(NOW,r->starttime)*1000);
+    if (out_format>1) // new format, also says what size the network ran at
+       writer_printf(&out,", \"network_size\": [%d, %d]}", r->model->w[r->size], r->model->h[r->size]);
+  }
+  if (out.buf==NULL) {
+    ERR("Out of memory building response\n");
+    r->status = 500;
+    out.len = 0;
+  }
+  r->response = out.buf;
+  r->response_len = out.len;
+  r->t_done = NOW;
+  record_timing(T_NMS, r->t_post, r->t_json);
+  record_timing(T_SERIALIZE, r->t_json, r->t_done);
+}
+
+void classify(Request *r, float *probs, int classes) {
+  // a classifier's answer: its top classes, each given as a box covering the whole image
+  int i, top[CLASSIFY_TOP], n = classes<CLASSIFY_TOP ? classes : CLASSIFY_TOP;
+  int w = (r->im.w-2*r->pad_w)/r->scale, h = (r->im.h-2*r->pad_h)/r->scale;
+  top_k(probs, classes, n, top);
+  r->boxes = malloc(n*sizeof(Box)+1);
+  for (i=0; i<n; i++) {
+    Box b = {top[i], probs[top[i]], w/2, h/2, w, h, -1, 0};
+    r->boxes[i] = b;
+  }
+  r->num_boxes = n;
+  r->cached = 1;
+}
+
+int run_batch(Worker *wk, network *net, int n) {
+  // call yolo to do the object detection (or classification) on a batch of n images, then pass them on for NMS.
+  // those wanting a cascade are kept back, moved to the start of wk->batch with their boxes.  returns how many
+  int i, held=0;
+  long t_yolo = NOW;
+  float *input = wk->batch[0]->im.data;
+  if (n>1) { // gather the images into one input buffer
+    input = wk->input;
+    for (i=0; i<n; i++) memcpy(input+i*net->inputs, wk->batch[i]->im.data, net->inputs*sizeof(float));
+  }
+  if (net->batch != n) set_batch_network(net, n); // buffers are sized for batch_size, so can run fewer
+  network_predict(net, input);
+  __sync_fetch_and_add(&stats.batches[n], 1);
+  DEBUG_TIME("worker %d: batch of %d\n", wk->id, n);
+
+  // pick out detections now, since the next batch will overwrite the network output
+  float thresh=.5, hier_thresh=.5;
+  long t_post = NOW;
+  for (i=0; i<n; i++) {
+    Request *r = wk->batch[i];
+    r->t_yolo = t_yolo; r->t_post = t_post;
+    record_timing(T_INFER, t_yolo, t_post);
+    if (r->model->detector) {
+      r->dets = get_network_boxes_batch(net, i, r->im.w, r->im.h, thresh, hier_thresh, 0, 0, &r->nboxes);
+    } else {
+      classify(r, net->output+i*net->outputs, net->outputs);
+    }
+    if (r->cascade && r->model->detector) { // needs its image for the crops
+      make_boxes(r, thresh);
+      wk->batch[held++] = r;
+      continue;
+    }
+    release_image(r);
+    stage_push(&post_queue, r);
+  }
+  return held;
+}
+
+void run_cascade(Worker *wk, Request *r) {
+  // classify each box found in r's image with the r->cascade model.  the boxes are letterboxed from the (letterboxed)
+  // image in memory and go through the network in batches, then r is passed on to build its response
+  Model *m = r->cascade;
+  network *net = model_acquire(wk, m, 0);
+  int i, j, batch = model_batch(m);
+  for (i=0; i<r->num_boxes; i+=batch) {
+    int n = r->num_boxes-i < batch ? r->num_boxes-i : batch;
+    for (j=0; j<n; j++) {
+      // box in the network input image, less any padding
+      Box *b = &r->boxes[i+j];
+      int x0 = b->x*r->scale + r->pad_w - b->w*r->scale/2, x1 = x0 + b->w*r->scale;
+      int y0 = b->y*r->scale + r->pad_h - b->h*r->scale/2, y1 = y0 + b->h*r->scale;
+      if (x0 < r->pad_w) x0 = r->pad_w;
+      if (y0 < r->pad_h) y0 = r->pad_h;
+      if (x1 > r->im.w-r->pad_w) x1 = r->im.w-r->pad_w;
+      if (y1 > r->im.h-r->pad_h) y1 = r->im.h-r->pad_h;
+      int w = x1>x0 ? x1-x0 : 1, h = y1>y0 ? y1-y0 : 1;
+      if (x0+w > r->im.w) x0 = r->im.w-w;
+      if (y0+h > r->im.h) y0 = r->im.h-h;
+      // letterboxed straight from the box in r's image into this one's slot in the batch
+      image sized = {net->w, net->h, net->c, wk->input+j*net->inputs};
+      fill_image(sized, .5);
+      letterbox_crop_into(r->im, x0, y0, w, h, net->w, net->h, sized, RESIZE_BILINEAR);
+    }
+    if (net->batch != n) set_batch_network(net, n);
+    network_predict(net, wk->input);
+    for (j=0; j<n; j++) {
+      Box *b = &r->boxes[i+j];
+      float *probs = net->output+j*net->outputs;
+      top_k(probs, net->outputs, 1, &b->sub);
+      b->sub_prob = probs[b->sub];
+    }
+  }
+  model_release(wk, m, 1);
+  __sync_fetch_and_add(&stats.crops, r->num_boxes);
+  DEBUG_TIME("worker %d: classified %d boxes with %s\n", wk->id, r->num_boxes, m->name);
+  release_image(r);
+  r->t_post = NOW;
+  stage_push(&post_queue, r);
+}
+
+void* decode_thread(void* param) {
+  // take requests off the request queue, decode them and pass them on to the inference workers
+  int id = (int)(intptr_t)param;
+  JpegDecoder *dec = jpeg_decoder_new();
+  while (1) {
+    Request *r = next_request();
+    long start = now_us();
+    int res = decode_request(id, dec, r);
+    if (res==0 && r->track_k>1 && r->model->detector) {
+      r->cached = track_frame(r);
+      __sync_fetch_and_add(r->cached ? &stats.tracked : &stats.keyframes, 1);
+    }
+    if (res==0 && !r->cached && repeat_threshold>0) r->cached = cache_lookup(r); // same as client's last frame?
+    if (r->cached) { // skip the network
+      release_image(r);
+      r->t_yolo = r->t_post = r->t_ready;
+    }
+    __sync_fetch_and_add(&stats.busy[STAGE_DECODE], now_us()-start);
+    if (res<0) {
+      finish_request(r); // failed, response is NULL
+    } else {
+      stage_push(r->cached ? &post_queue : &infer_queue, r);
+    }
+  }
+  return NULL;
+}
+
+void* worker_thread(void* param) {
+  // run decoded images through the network in batches of up to batch_size.  a batch goes as soon as
+  // it's full or batch_window has passed since its first image arrived.  all images in a batch are for
+  // the same model and input size, one for another ends the batch and starts the next
+  Worker *wk = (Worker*)param;
+#ifdef GPU
+  cuda_set_device(gpu_index);
+#endif
+  while (1) {
+    int i, n=0, held;
+    Request *r = wk->pending ? wk->pending : stage_pop(&infer_queue, NULL);
+    wk->pending = NULL;
+    long start = now_us();
+    Model *m = r->model;
+    int size = r->size;
+    network *net = model_acquire(wk, m, size);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += batch_window*1000L;
+    deadline.tv_sec += deadline.tv_nsec/1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    wk->batch[n++] = r;
+    while (n<model_batch(m) && (r=stage_pop(&infer_queue, &deadline))!=NULL) {
+      if (r->model != m || r->size != size) {
+        wk->pending = r;
+        break;
+      }
+      wk->batch[n++] = r;
+    }
+    held = run_batch(wk, net, n);
+    model_release(wk, m, n);
+    for (i=0; i<held; i++) run_cascade(wk, wk->batch[i]);
+    __sync_fetch_and_add(&stats.busy[STAGE_INFER], now_us()-start);
+  }
+  return NULL;
+}
+
+void* post_thread(void* param) {
+  // do NMS and build the response for requests that have been through the network
+  while (1) {
+    Request *r = stage_pop(&post_queue, NULL);
+    long start = now_us();
+    build_response(r, .5);
+    free(r->boxes);
+    r->boxes = NULL;
+    free(r->luma);
+    r->luma = NULL;
+    finish_request(r);
+    __sync_fetch_and_add(&stats.busy[STAGE_POST], now_us()-start);
+  }
+  return NULL;
+}
+
+void dump_image(char *data, int len) {
+  // dump received image out to a file (used for debugging)
+  FILE *f; char fname[1024];
+  sprintf(fname, "img_%d.jpg",count); count++;
+  f = fopen(fname,"wb");
+  fwrite(data,len,1,f);
+  fclose(f);
+}
+
+// TCP connections are handled by a small number of I/O threads, each running an edge-triggered
+// epoll loop over its share of the connections.  Each connection has a ring of up to MAX_PIPELINE
+// requests, in the order they arrived: the newest may still be being read, the others are with the
+// workers or have finished and are waiting for their response to be sent (HTTP responses must go back
+// in order).  When the ring is full we stop reading from the socket, so a client that sends faster than
+// we can process is throttled by TCP flow control and per-connection memory stays bounded.
+
+typedef struct IOThread {
+  int id;
+  int epoll_fd;
+  int event_fd; // workers poke this when a request has finished
+  Request *done_head; // requests that have finished
+  pthread_mutex_t done_mutex;
+  struct Connection *closed; // connections closed during this batch of events, freed after it
+  pthread_t thread;
+} IOThread;
+
+typedef struct Connection {
+  int fd;
+  IOThread *io;
+  int binary; // using binary protocol rather than HTTP, -1 until we've seen the first bytes
+  int closing; // no more requests to be read, close once responses have been sent
+  int dead; // socket has failed, close as soon as workers are finished with our requests
+  int closed; // socket closed, waiting to be freed at the end of the event batch
+  struct Connection *next_closed;
+  char inbuf[BUFFER_SIZE]; // receive buffer, request headers are parsed in place here
+  size_t inbuf_used;
+  HttpParser parser; // parser state of request being read
+  Request reqs[MAX_PIPELINE]; // ring of requests in order of arrival
+  int req_head, req_count;
+  int reading; // newest request in ring is still being read
+  int inflight; // number of requests with the workers
+  size_t body_read, body_size; // POST data read so far, and size of buffer
+  char outhead[256]; // HTTP or binary header of response being sent
+  char *outbody; // body of response being sent (a pool buffer)
+  struct iovec out[3]; // header, body and trailing newline
+  int out_iovs;
+  size_t out_len, out_sent; // bytes in response, and sent so far.  out_len is 0 if nothing to send
+  long out_start, out_done; // when request being answered arrived and response was ready, for metrics
+  int out_status;
+} Connection;
+
+IOThread *io_threads;
+int listen_fd=-1;
+char listen_marker; // epoll user data for the listening socket
+
+#define CONN_REQ(c,i) (&(c)->reqs[((c)->req_head+(i))%MAX_PIPELINE])
+
+void io_request_done(Request *r) {
+  // called by a worker: queue request for its connection's I/O thread and wake it up
+  IOThread *io = r->conn->io;
+  uint64_t one=1;
+  pthread_mutex_lock(&io->done_mutex);
+  r->next = io->done_head;
+  io->done_head = r;
+  pthread_mutex_unlock(&io->done_mutex);
+  if (write(io->event_fd, &one, sizeof(one))<0) {
+    ERR("Failed to wake I/O thread %d: %s\n", io->id, strerror(errno));
+  }
+}
+
+void conn_close(Connection *c) {
+  DEBUG_HTTP("closing connection %d\n", c->fd);
+  int i;
+  close(c->fd); // also removes it from epoll set
+  for (i=0; i<c->req_count; i++) {
+    Request *r = CONN_REQ(c,i);
+    pool_put(r->post_data); pool_put(r->response);
+  }
+  pool_put(c->outbody);
+  // later events in the same epoll_wait batch can still point at c, so it's freed once the batch is done
+  c->closed = 1;
+  c->next_closed = c->io->closed;
+  c->io->closed = c;
+}
+
+void conn_finish_request(Connection *c, Request *r, int status, char *response) {
+  // request won't be going to the workers, give it its response now
+  r->status = status;
+  r->response_len = strlen(response);
+  r->response = pool_get(r->response_len);
+  if (r->response) memcpy(r->response, response, r->response_len);
+  r->done = 1;
+}
+
+void conn_bad_request(Connection *c, int status) {
+  // the request being read is bad.  answer it and stop reading, since we can't trust what follows
+  Request *r = CONN_REQ(c, c->req_count-1);
+  c->reading = 0;
+  c->closing = 1;
+  r->keep_alive = 0;
+  conn_finish_request(c, r, status, "[]");
+}
 
-#ifdef LIBJPEG
-    // decode jpeg and scale to fit within net_w by net_h box after rotation applied (but rotation not yet
-    // applied of course)
-    *rgb_data = libjpg_load_from_memory(buff, len, rotation, net_w, net_h, w, h, c, scale);
-#else
-    *rgb_data = stbi_load_from_memory(buff, len, w, h, c, 3);
-    if (!rgb_data) {
-        ERR("Cannot load image, STB Reason: %s\n", stbi_failure_reason());
-        return -1;
-    }
-    *scale=1.0; 
-#endif
-   return 0;
+void conn_request_ready(Connection *c) {
+  // the newest request has been read in full, hand it on to the workers
+  Request *r = CONN_REQ(c, c->req_count-1);
+  c->reading = 0;
+  r->len = c->body_read;
+  r->keep_alive = c->parser.keep_alive;
+  if (!r->keep_alive) c->closing=1;
+  if (r->endpoint == EP_DUMMY) {
+    conn_finish_request(c, r, 200, "[]");
+    return;
+  }
+  if (r->endpoint == EP_RELOAD) {
+    request_reload(r->model);
+    conn_finish_request(c, r, 202, "{\"reload\": \"started\"}");
+    return;
+  }
+  if (r->endpoint == EP_STATS || r->endpoint == EP_METRICS) {
+    char json[4*BUFFER_SIZE];
+    if (r->endpoint == EP_STATS) stats_json(json, sizeof(json));
+    else metrics_json(json, sizeof(json));
+    conn_finish_request(c, r, 200, json);
+    return;
+  }
+  if (save_to_file) dump_image(r->post_data, r->len);
+  c->inflight++;
+  submit_request(r);
 }
 
-void rotate_and_convert(unsigned char *rgb_data, int w, int h, int c, int rotation, int net_w, int net_h,
-                        image *im, float *scale, int *pad_w, int*pad_h) { 
-    // apply any requested rotation and rearrange pixels to bitmap format used by yolo 
-    // (we assume that net_w=net_h).  we keep everything as integers for now as helps
-    // with CPU caching (image is 4 times smaller than when converted to floats) 
-    int i,j,k,dst_index,src_index;
-
-    DEBUG_JPG("Converting to yolo format and rotating image by %d ...\n", rotation);
-    DEBUG_JPG("rot=%d\n",rotation);
-    unsigned char* yolo_data = malloc(w*h*c);
-    switch (rotation) {
-      case 90:
-         for(k = 0; k < c; ++k){
-         for(i = 0; i < w; i++){
-            dst_index = h-1-0 + h*i + w*h*k;
-            src_index = k + c*i + c*w*0;
-            for(j = 0; j < h; ++j){
-               yolo_data[dst_index] = rgb_data[src_index];
-               dst_index--;
-               src_index+=c*w;
-            }
-         }
-         }
-         break;
-      case 180:
-         for(k = 0; k < c; ++k){
-         for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-               src_index = k + c*i + c*w*j;
-               dst_index = (w-1-i) + w*(h-1-j) + w*h*k;
-               yolo_data[dst_index] = rgb_data[src_index];
-            }
-         }
-         }
-         break;
-      case 270:
-      case -90:
-         for(k = 0; k < c; ++k){
-            for(i = 0; i < w; ++i){
-              src_index = k + c*i + c*w*(h-1);
-              dst_index = (h-1)+h*(w-1-i)+w*h*k;
-              for(j = h-1; j >= 0; j--){ // runs x3 faster when count down rather than up (caching I guess ...)
-                 //src_index = k + c*i + c*w*j;
-                 //dst_index = j+h*(w-1-i)+w*h*k;
-                 yolo_data[dst_index] = rgb_data[src_index];
-                 dst_index--; src_index-=c*w;
-            }
+int conn_body_reserve(Connection *c, size_t n) {
+  // make sure body buffer of request being read can take another n bytes
+  Request *r = CONN_REQ(c, c->req_count-1);
+  if (c->body_read+n <= c->body_size) return 0;
+  if (c->body_read+n > MAXLEN) {
+    ERR("POST data too large (more than %d bytes)\n", MAXLEN);
+    return -1;
+  }
+  r->post_data = pool_grow(r->post_data, c->body_read, c->body_read+n);
+  if (r->post_data==NULL) return -1;
+  c->body_size = pool_size(r->post_data);
+  return 0;
+}
+
+void conn_parse(Connection *c) {
+  // parse as many requests as we can from what's in inbuf
+  while (!c->closing && !c->dead) {
+    if (!c->reading) {
+      // start on the next request, if there's room
+      if (c->inbuf_used==0 || c->req_count==MAX_PIPELINE) return;
+      Request *r = CONN_REQ(c, c->req_count);
+      memset(r, 0, sizeof(Request));
+      r->starttime = NOW;
+      r->conn = c;
+      c->req_count++;
+      c->reading = 1;
+      c->body_read = 0; c->body_size = 0;
+      http_init(&c->parser);
+    }
+    HttpParser *p = &c->parser;
+    Request *r = CONN_REQ(c, c->req_count-1);
+    size_t consumed;
+    if (c->binary<0) {
+      // first request on connection, which protocol is it using?
+      if (c->inbuf_used<4 && !memcmp(c->inbuf, BIN_MAGIC, c->inbuf_used)) return; // can't tell yet
+      c->binary = !memcmp(c->inbuf, BIN_MAGIC, 4);
+    }
+    if (p->state==HTTP_REQ_LINE || p->state==HTTP_HEADERS) {
+      int res = c->binary ? bin_parse_head(p, c->inbuf, c->inbuf_used, r) : http_parse_head(p, c->inbuf, c->inbuf_used, r);
+      if (res==0) {
+        if (c->inbuf_used==BUFFER_SIZE) {
+          ERR("HTTP request headers larger than %d.\n",BUFFER_SIZE);
+          conn_bad_request(c, 431);
         }
+        return;
+      }
+      if (res<0) {
+        conn_bad_request(c, 400);
+        return;
+      }
+      if (p->state==HTTP_BODY) {
+        if (p->content_length > MAXLEN) {
+          ERR("POST data too large (%ld bytes)\n", p->content_length);
+          conn_bad_request(c, 413);
+          return;
         }
-         break;
-      case 0:
-      default:
-        for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            src_index = k + c*(w-1) + c*w*j;
-            dst_index = (w-1) + w*j + w*h*k;
-            for(i = w-1; i >=0; i--){ // runs x3 faster when count down rather than up (caching I guess ...)
-               //src_index = k + c*i + c*w*j;
-               //dst_index = i + w*j + w*h*k;
-               yolo_data[dst_index] = rgb_data[src_index];
-               dst_index--; src_index-=c;
-            }
+        // body has a known size, get a buffer for it in one go
+        r->post_data = pool_get(p->content_length);
+        if (r->post_data==NULL) {
+          conn_bad_request(c, 413);
+          return;
         }
-       }
-   }
+        c->body_size = p->content_length;
+      }
+    }
+    if (p->state==HTTP_BODY) {
+      // move over any body bytes already in inbuf, the rest will be read straight into the body
+      size_t n = c->inbuf_used - p->posn;
+      if (n > c->body_size - c->body_read) n = c->body_size - c->body_read;
+      memcpy(r->post_data+c->body_read, c->inbuf+p->posn, n);
+      c->body_read += n;
+      consumed = p->posn+n;
+    } else if (p->state==HTTP_DONE) {
+      consumed = p->posn; // no body
+    } else {
+      // chunked body, copy out the data from between the chunk headers
+      const char *data; size_t len;
+      int res, too_large=0;
+      while ((res=http_parse_chunked(p, c->inbuf, c->inbuf_used, &data, &len))==1) {
+        if (conn_body_reserve(c, len)<0) { res=-1; too_large=1; break; }
+        memcpy(r->post_data+c->body_read, data, len);
+        c->body_read += len;
+      }
+      if (res<0) {
+        conn_bad_request(c, too_large ? 413 : 400);
+        return;
+      }
+      consumed = p->posn;
+    }
+    // drop what we've used from inbuf (normally nothing is left, unless requests are pipelined)
+    memmove(c->inbuf, c->inbuf+consumed, c->inbuf_used-consumed);
+    c->inbuf_used -= consumed;
+    p->posn = 0;
+    if ((p->state==HTTP_BODY && c->body_read==c->body_size) || p->state==HTTP_DONE) {
+      conn_request_ready(c);
+    } else {
+      return; // need more data
+    }
+  }
+}
 
-   int w_rot=w, h_rot=h;
-   if ((rotation%180==90) || (rotation%180==-90)) {
-         w_rot=h; h_rot=w; 
-   }
-   int size = w_rot>h_rot ? w_rot : h_rot;
-   if (size < net_w) size=net_w;
-   *pad_w = (size-w_rot)/2; *pad_h = (size-h_rot)/2;
-   *im = make_image(size, size, c);
-   for(k = 0; k < c; ++k){
-      for(j = 0; j < h_rot; ++j){
-         dst_index = (w_rot-1+*pad_w) + size*(j+*pad_h) + size*size*k;
-         src_index = (w_rot-1)+w_rot*j+w_rot*h_rot*k;
-         for(i = w_rot-1; i >=0; i--){
-            //im->data[dst_index] = (float)yolo_data[src_index]/255.;
-            im->data[dst_index] =  u8tofloat(yolo_data[src_index]);
-            dst_index--; src_index--;
-         }
+void conn_read(Connection *c) {
+  // read whatever is available on the socket, parsing as we go
+  conn_parse(c); // requests left in inbuf while the ring was full come first, there'll be no new event for them
+  while (!c->closing && !c->dead && (c->reading || c->req_count < MAX_PIPELINE)) {
+    HttpParser *p = &c->parser;
+    ssize_t rv;
+    char *dst; size_t n;
+    if (c->reading && c->inbuf_used==0 && p->state==HTTP_BODY) {
+      // read POST data straight into body buffer
+      dst = CONN_REQ(c, c->req_count-1)->post_data + c->body_read;
+      n = c->body_size - c->body_read;
+    } else if (c->reading && c->inbuf_used==0 && p->state==HTTP_CHUNK_DATA) {
+      // likewise for a chunk of a chunked body
+      if (conn_body_reserve(c, p->chunk_left)<0) {
+        conn_bad_request(c, 413);
+        return;
       }
-   }
-   free(rgb_data); free(yolo_data);
-
-   // resize image if necessary (will never be called if have used libjpeg)
-   if (size > net_w || size > net_h) { // only scale down, not up (is this ok ?) 
-      DEBUG_JPG("Resizing image from w:%d h:%d to w:%d h:%d\n",im->w,im->h,net_w,net_h);
-      // this call is slooow ...
-      image resized = resize_image(*im, net_w, net_h);
-      free_image(*im);
-      *im = resized;
-      *scale = net_w*1.0/size;
-    }
-  DEBUG_JPG("done\n");
-}
-
-uint8_t clamp(int16_t value) {
-   return value<0 ? 0 : (value>255 ? 255 : value);
-}
-
-void yuv2rgb(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b) {
-   // yuvimage conversion values (from wikipedia):
-   // int rTmp = yValue + (1.370705 * (vValue-128));
-   // int gTmp = yValue - (0.698001 * (vValue-128)) - (0.337633 * (uValue-128));
-   // int bTmp = yValue + (1.732446 * (uValue-128));
-   int y1192 = 1192 * y;
-   int r_tmp = (y1192 + 1634 * (v-128))/1192;
-   int g_tmp = (y1192 - 833 * (v-128) - 400 * (u-128))/1192;
-   int b_tmp = (y1192 + 2066 * (u-128))/1192;
- 
-   *r =clamp(r_tmp);  *g =clamp(g_tmp);  *b =clamp(b_tmp);
-}
-
-void convertYUVtoRGB(unsigned char *yuv, int len, int w, int h, float scale, unsigned char **rgb) {
-   // really NV21 to RGB
-   // see https://en.wikipedia.org/wiki/YUV#Y%E2%80%B2UV420p_(and_Y%E2%80%B2V12_or_YV12)_to_RGB888_conversion
-   int i,j,k;
-   *rgb = malloc(w*h*3);
-   float hcount=0, wcount=0;   
-   for (j=0; j<h; j++) {
-      wcount=0;
-      for (i=0; i<w; i++) {
-         uint8_t y = yuv[j * w  + i];
-         uint8_t u = yuv[(j / 2) * w  + (i/2)*2  + 1 + w*h];
-         uint8_t v = yuv[(j / 2) * w  + (i/2)*2  + w*h];
-         int dst=(int)(hcount)*(int)(w*scale)*3 + (int)(wcount)*3;
-         yuv2rgb(y, u, v, &(*rgb)[dst], &(*rgb)[dst+1], &(*rgb)[dst+2]);   
-         wcount+=scale;
+      dst = CONN_REQ(c, c->req_count-1)->post_data + c->body_read;
+      n = p->chunk_left;
+    } else {
+      dst = c->inbuf+c->inbuf_used;
+      n = BUFFER_SIZE-c->inbuf_used;
+    }
+    if (n==0) return; // nowhere to put it (recv would return 0, which isn't EOF)
+    rv = recv(c->fd, dst, n, 0);
+    if (rv == 0) {
+      if (c->reading) {
+        WARN("HTTP connection closed mid-request.\n");
+        Request *r = CONN_REQ(c, c->req_count-1);
+        pool_put(r->post_data);
+        c->req_count--; c->reading=0;
       }
-      hcount += scale;
-   }
-   /*
-   // for debugging .. dump out bitmap as .ppm file so we can look at it
-   int ww=(int)(w*scale), hh=(int)(h*scale);
-   FILE *f = fopen("img.ppm", "w");
-   fprintf(f,"P3\n%d %d\n255\n",ww,hh);
-   for (j=0; j<hh; j++) {
-      for (i=0; i<ww; i++) {
-         fprintf(f,"%d %d %d ",(int)(*rgb)[j*ww*3+i*3],(int)(*rgb)[j*ww*3+i*3+1],(int)(*rgb)[j*ww*3+i*3+2]);
+      c->closing=1;
+      return;
+    }
+    if (rv < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return; // wait for more data
+      if (errno == EINTR) continue;
+      ERR("HTTP connection error: %s\n",strerror(errno));
+      c->dead=1;
+      return;
+    }
+    if (dst == c->inbuf+c->inbuf_used) {
+      c->inbuf_used += rv;
+    } else {
+      c->body_read += rv;
+      if (p->state==HTTP_CHUNK_DATA) {
+        p->chunk_left -= rv;
+        if (p->chunk_left==0) p->state=HTTP_CHUNK_END;
+      } else if (c->body_read==c->body_size) {
+        conn_request_ready(c);
       }
-      fprintf(f,"\n");
-   }
-   fclose(f);
-   */
+    }
+    conn_parse(c);
+  }
 }
 
-void display_detections(detection *dets, int num, float thresh, char **names, int classes) {
-    // print classification output
-    int i,j;
-    if (!verbose) return;
-    for(i = 0; i < num; ++i){
-        for(j = 0; j < classes; ++j){
-            if (dets[i].prob[j] > thresh){
-                printf("%s: %.0f%%\n", names[j], dets[i].prob[j]*100);
-            }
-        }
+int conn_write(Connection *c) {
+  // send as much of the pending response as the socket will take. returns 1 when it has all gone
+  while (c->out_sent < c->out_len) {
+    // skip over what's already gone
+    struct iovec iov[3];
+    struct msghdr msg = {0};
+    size_t skip = c->out_sent;
+    int i;
+    for (i=0; i<c->out_iovs; i++) {
+      if (skip >= c->out[i].iov_len) { skip -= c->out[i].iov_len; continue; }
+      iov[msg.msg_iovlen].iov_base = (char*)c->out[i].iov_base + skip;
+      iov[msg.msg_iovlen].iov_len = c->out[i].iov_len - skip;
+      msg.msg_iovlen++;
+      skip = 0;
+    }
+    msg.msg_iov = iov;
+    ssize_t rv = sendmsg(c->fd, &msg, MSG_NOSIGNAL); // writev, but without SIGPIPE
+    if (rv < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0; // wait for EPOLLOUT
+      if (errno == EINTR) continue;
+      WARN("HTTP send error: %s\n", strerror(errno));
+      c->dead=1;
+      return 0;
     }
+    c->out_sent += rv;
+  }
+  response_sent(c->out_start, c->out_done, c->out_status, c->out_len);
+  pool_put(c->outbody); c->outbody=NULL;
+  c->out_len=0; c->out_sent=0;
+  return 1;
 }
 
-void close_session(int *session_fd, int send_fd, struct sockaddr_in* si_active, int slen,
-                   char* msg, int len) {
-   char* buf = "[]";
-   if (msg==NULL) {
-      DEBUG_UDP("closing connection, sending empty pkt\n");
-      msg=buf; len=2; // send empty response.
-   }
-   sendto(send_fd,msg,len,0,(struct sockaddr*)si_active,slen);
-   if (slen>0) { //its UDP
-      // send a couple more, in case of loss (extras will be ignored by client)
-      sendto(send_fd,msg,len,0,(struct sockaddr*)&si_active,slen);
-      sendto(send_fd,msg,len,0,(struct sockaddr*)&si_active,slen);
-   } else { // try to flush tcp sock
-      int nodelay=1;
-      if (setsockopt(send_fd,IPPROTO_TCP,TCP_NODELAY,&nodelay,sizeof(nodelay))<0) {
-        WARN("Failed to set TCP_NODELAY socket option");
-       }
-   }
-   // close the incoming link.  
-   // NB for TCP connections incoming and outgoing links (session_fd, send_fd) are the same
-   // but for UDP outgoing send_fd link is separate and may be shared by other connections
-   // so important not to close it
-   if (*session_fd != -1) { close(*session_fd); *session_fd=-1;}
-}
-
-void flagGPUfree() {
-   // flag that GPU is now available
-   pthread_mutex_lock(&active_mutex);
-   active = 0; // flag GPU as free
-   pthread_mutex_unlock(&active_mutex);
-}
-
-void* handle_connection(void* params) {
-  // read HTTP request and process it.  handles both udp and tcp connections
-  Params *p = (Params*)params;
-
-  // take a copy of passed parameters, so caller is free to reuse params object 
-  int session_fd = p->session_fd;
-  int send_fd = p->send_fd;
-  int slen = p->slen;
-  int isTCP = (slen==0);
-  struct sockaddr_in *si_active, si_active_buf;
-  if (isTCP) // TCP 
-     si_active=NULL;
-  else { // UDP
-     memcpy(&si_active_buf,&p->si_active,slen);
-     si_active=&si_active_buf;
-  }
-  reassembly_info* r_info = (reassembly_info*)p->ptr;
- 
-  // read from socket image to be processed
-start: // nasty temporary goto hack for tcp
-  do {} while (0);// dummy
-  TICK(starttime);
-  char post_data[MAXLEN];
-  int len=-1;
-  int out_format=0, rotation=0, isYUV=0, w=0, h=0, c=3;
-  if (get_post_data(session_fd, post_data, &len, &out_format, &rotation, &isYUV, &w, &h)<0) {
-    if (r_info) dump_reassembly_state(r_info); // for debugging
-    close_session(&session_fd,send_fd,si_active,slen,NULL,0); 
-    flagGPUfree();
-    pthread_exit(NULL);
-  }
-
-  if (save_to_file) {
-    // dump received image out to a file (used for debugging)
-    FILE *f; char fname[1024];
-    sprintf(fname, "img_%d.jpg",count); count++;
-    f = fopen(fname,"wb");
-    fwrite(post_data,len,1,f);
-    fclose(f);
+char* http_status_text(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 202: return "Accepted";
+    case 400: return "Bad Request";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 503: return "Service Unavailable";
+    default: return "Error";
   }
-  
-  // decode image to get bitmap in yolo format
-  TICK(starttime_decode);
-  float scale=1.0; int pad_w=0, pad_h=0;
-  image im;
-  unsigned char* rgb_data;
-  if (!isYUV) { // parse JPEG
-    if (load_image_mem((unsigned char*)post_data,(int)len,rotation,net->w,net->h,&rgb_data,&w,&h,&c,&scale)<0){
-      close_session(&session_fd,send_fd,si_active,slen,NULL,0);
-      flagGPUfree();
-      pthread_exit(NULL);
-    }
-  } else {
-     // convert YUV to RGB
-     if (w*h*3/2 != len) {
-        WARN("POST YUV data len %d does not match supplied image size w=%d, h=%d, c=%d\n",len,w,h,c);
-        close_session(&session_fd,send_fd,si_active,slen,NULL,0);
-        flagGPUfree();
-        pthread_exit(NULL);
-     }
-     int dst_w=w, dst_h=h;
-     if ((rotation%180==90) || (rotation%180==-90)) {
-        dst_w=h; dst_h = w;
-     }
-     scale = dst_w>dst_h ? net->w*1.0/dst_w : net->h*1.0/dst_h;
-     if (scale>1.0) scale=1.0;
-     convertYUVtoRGB((unsigned char*)post_data, len, w, h, scale, &rgb_data);
-     w=w*scale; h=h*scale;
-  };
-  DEBUG_JPG("w=%d, h=%d, net_w=%d, net_h=%d\n", w, h, net->w, net->h);
- 
-  TICK(starttime_rot);
-  rotate_and_convert(rgb_data, w, h, c, rotation, net->w, net->h, &im, &scale, &pad_w, &pad_h);
-
-  // finally call yolo to do the object detection
-  TICK(starttime_yolo);
-  network_predict(net, im.data);
-  int nboxes = 0;
-  float thresh=.5, hier_thresh=.5;
-  detection *dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 0, &nboxes);
-
-  flagGPUfree();
-  free_image(im);
-
-  TICK(starttime_results);
-  // build the response to send back to client ...
-  int classes=0;
-  // construct json response
-  int json_size = BUFFER_SIZE;
-  char* json=malloc(json_size);
-  if (out_format>1) { // new format
-     strcpy(json,"{");
-     strcat(json,"\"results\": [");
-  } else
-     strcpy(json,"[");
+}
 
-  if (nboxes>0) {
-    classes=dets[0].classes;
-    float nms=.45;
-    do_nms_sort(dets, nboxes, classes, nms);  
-    //display_detections(dets, nboxes, thresh, names, classes);
-    
-    int i,j,count=0;
-    for(i = 0; i < nboxes; ++i){
-      for(j = 0; j < classes; ++j){
-        if (dets[i].prob[j] > thresh){
-          if (count) {strcat(json,",");}
-          char tuple[BUFFER_SIZE];
-          int x,y;
-          x=(int)(dets[i].bbox.x-pad_w)/scale;
-          y=(int)(dets[i].bbox.y-pad_h)/scale;
-          int w=(int)dets[i].bbox.w/scale;
-          int h=(int)dets[i].bbox.h/scale;
-          float p=dets[i].prob[j];
-          switch (out_format) {
-          case 0: // victor's jsonpickle format ...
-              sprintf(tuple,"{\"py/tuple\": [\"%s\", %f, {\"py/tuple\": [%d,%d,%d,%d]}] }",
-                       names[j],p,x,y,w,h);
-             break;
-          case 1: // darragh's android json format ...
-             sprintf(tuple,"{\"topleft\": {\"y\": %d, \"x\": %d}, \"confidence\": %f, \"bottomRight\": {\"y\": %d, \"x\": %d}, \"label\": \"%s\"}",y-h/2,x-w/2,p,y+h/2,x+w/2,names[j]);
-             break;
-          default: // new improved JSON format
-             sprintf(tuple,"{\"title\": \"%s\", \"confidence\": %f, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d}",
-                       names[j],p,x,y,w,h);
-          }
-          if (strlen(json)+strlen(tuple) > json_size) {
-             // need to expand json buffer
-             json_size+=BUFFER_SIZE;
-             json = realloc(json, json_size);
-          }
-          strcat(json,tuple);
-          count++;
-        }
+int conn_flush(Connection *c) {
+  // send responses for finished requests, oldest first (or in any order for binary protocol).
+  // returns 1 if this freed up room for more requests
+  int freed=0, i;
+  while (!c->dead) {
+    if (c->out_len==0) {
+      Request *r = NULL;
+      for (i=0; i < c->req_count-c->reading; i++) {
+        Request *q = CONN_REQ(c,i);
+        if (q->done && !q->sent) { r=q; break; }
+        if (!c->binary) break; // HTTP responses must go in order
+      }
+      if (r==NULL) break;
+      char *body = r->response;
+      int body_len = r->response_len;
+      int json = r->out_format!=OUT_BINARY;
+      if (body==NULL) { // processing failed, or dropped from queue
+        if (!r->status) r->status = 400;
+        body = json ? "[]" : ""; body_len = strlen(body);
+      }
+      int status = r->status ? r->status : 200;
+      int size = r->endpoint==EP_DETECT && r->model ? r->model->w[r->size] : 0;
+      int head_len;
+      if (c->binary) {
+        BinResponse h;
+        memcpy(h.magic, BIN_RESPONSE_MAGIC, 4);
+        h.id = r->bin_id; h.status = status; h.size = size; h.len = body_len;
+        memcpy(c->outhead, &h, sizeof(h));
+        head_len = sizeof(h);
+        json = 0; // no newline on the end
+        DEBUG_JSON("%u: %.*s\n", r->bin_id, body_len, body);
+      } else {
+        // send HTTP response headers for backward compatibility
+        int keep_alive = r->keep_alive && !(c->closing && c->req_count==1);
+        head_len = sprintf(c->outhead,"HTTP/1.1 %d %s\r\nContent-Type: %s\r\nConnection: %s\r\nContent-Length: %d\r\n",
+                           status, http_status_text(status), json ? "application/json" : "application/octet-stream",
+                           keep_alive ? "keep-alive" : "close", body_len+json);
+        if (size) head_len += sprintf(c->outhead+head_len, "X-Network-Size: %dx%d\r\n", size, r->model->h[r->size]);
+        head_len += sprintf(c->outhead+head_len, "\r\n");
+        DEBUG_JSON("%s%.*s\n", c->outhead, body_len, body);
+      }
+      c->out[0].iov_base = c->outhead; c->out[0].iov_len = head_len;
+      c->out[1].iov_base = body; c->out[1].iov_len = body_len;
+      c->out[2].iov_base = "\n"; c->out[2].iov_len = json;
+      c->out_iovs = 3;
+      c->out_len = head_len+body_len+json;
+      c->out_start = r->endpoint==EP_DETECT ? r->starttime : 0;
+      c->out_done = r->t_done;
+      c->out_status = status;
+      c->out_sent = 0;
+      c->outbody = r->response; // goes back to pool once sent
+      pool_put(r->post_data);
+      r->post_data = NULL; r->response = NULL;
+      r->sent = 1;
+      // requests at the head of the ring that have been answered can go
+      while (c->req_count > c->reading && CONN_REQ(c,0)->sent) {
+        c->req_head = (c->req_head+1)%MAX_PIPELINE;
+        c->req_count--;
+        freed=1;
       }
     }
+    if (!conn_write(c)) break;
   }
-  strcat(json,"], ");
-  
-  char json_timing[BUFFER_SIZE];
-  sprintf(json_timing,"\"server_timings\": {\"size\": %d, \"r\": %.1f, \"jpg\": %.1f, \"rot\": %.1f, \"yolo\": %.1f, \"json\": %.1f, \"tot\": %.1f}",
-             len, 
-             TOCK(starttime_decode,starttime)*1000,
-             TOCK(starttime_rot,starttime_decode)*1000,
-             TOCK(starttime_yolo,starttime_rot)*1000,
-             TOCK(starttime_results,starttime_yolo)*1000, 
-             TOCK(NOW,starttime_results)*1000,
-             TOCK(NOW,starttime)*1000);
-  DEBUG_TIME("%s\n", json_timing);
-
-  if (strlen(json)+strlen(json_timing) > json_size) {
-    // need to expand json buffer
-    json_size+=BUFFER_SIZE;
-    json = realloc(json, json_size);
-  }
-  strcat(json,json_timing);
-
-  // strcat(json_final,"]"); // printf("%s, %d\n",json,strlen(json));
-  if (out_format>1) // new format
-     strcat(json,"}");
-  free_detections(dets, nboxes);
-  
-  // send the response and shut down connection
-  int res;
-  if (isTCP) { //TCP, send HTTP response headers for backward compatibility
-    char* header=malloc(json_size+BUFFER_SIZE);
-    sprintf(header,"HTTP/1.1 200 OK\nContent-Type: application/json\nConnection: close\nContent-Length: %d\n\n%s\n",(int)strlen(json),json);
-    DEBUG_JSON("%s\n", header);
-    //close_session(&session_fd,send_fd,si_active,slen,header,strlen(header));
-    int temp_fd=-1; // keep session open
-    close_session(&temp_fd, send_fd, si_active, slen, header, strlen(header));
-    free(header); free(json);
-    goto start; // reuse tcp connection until client resets it.  nasty hack !
-  } else {// UDP, don't bother with HTTP headers
-    DEBUG_JSON("%s\n", json);
-    close_session(&session_fd,send_fd,si_active,slen,json,strlen(json));
-    free(json);
+  return freed;
+}
+
+void conn_service(Connection *c) {
+  // read new requests and send responses until we can do no more, then close connection if finished
+  if (c->closed) return;
+  do {
+    conn_read(c);
+  } while (conn_flush(c) && !c->closing);
+  if (c->inflight==0 && (c->dead || (c->closing && c->req_count==0 && c->out_len==0))) conn_close(c);
+}
+
+void conn_accept(IOThread *io) {
+  // accept all pending connections on the listening socket
+  while (1) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd==-1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        ERR("Failed to accept TCP connection: %s\n",strerror(errno));
+      }
+      return;
+    }
+    int nodelay=1;
+    if (setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&nodelay,sizeof(nodelay))<0) {
+      WARN("Failed to set TCP_NODELAY socket option");
+    }
+    Connection *c = calloc(1, sizeof(Connection));
+    c->fd = fd; c->io = io; c->binary = -1;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev)<0) {
+      ERR("Failed to add connection to epoll set: %s\n",strerror(errno));
+      close(fd); free(c);
+      continue;
+    }
+    DEBUG_HTTP("I/O thread %d accepted connection %d\n", io->id, fd);
   }
+}
 
-  pthread_exit(NULL);
+void* io_thread(void* param) {
+  // event loop for a set of TCP connections
+  IOThread *io = (IOThread*)param;
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    int i, n = epoll_wait(io->epoll_fd, events, MAX_EVENTS, -1);
+    if (n<0) {
+      if (errno != EINTR) ERR("epoll_wait failed: %s\n",strerror(errno));
+      continue;
+    }
+    for (i=0; i<n; i++) {
+      if (events[i].data.ptr == &listen_marker) {
+        conn_accept(io);
+        continue;
+      }
+      if (events[i].data.ptr == io) {
+        // workers have finished some requests
+        uint64_t val;
+        if (read(io->event_fd, &val, sizeof(val))<0 && errno != EAGAIN) {
+          ERR("Failed to read eventfd: %s\n",strerror(errno));
+        }
+        pthread_mutex_lock(&io->done_mutex);
+        Request *r = io->done_head;
+        io->done_head = NULL;
+        pthread_mutex_unlock(&io->done_mutex);
+        while (r) {
+          Request *next = r->next;
+          Connection *c = r->conn;
+          r->done = 1;
+          c->inflight--;
+          conn_service(c); // NB may close c
+          r = next;
+        }
+        continue;
+      }
+      Connection *c = (Connection*)events[i].data.ptr;
+      if (events[i].events & EPOLLERR) c->dead=1;
+      conn_service(c);
+    }
+    while (io->closed) {
+      Connection *c = io->closed;
+      io->closed = c->next_closed;
+      free(c);
+    }
+  }
+  return NULL;
 }
 
 void* accept_tcp(void* param) {
-  // listen on TCP port for http connections
+  // listen on TCP port for http connections and start the I/O threads
   int port = *(int*)param;
 
-  int server_fd=socket(AF_INET,SOCK_STREAM,0);
-  if (server_fd==-1) {
+  listen_fd=socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK,0);
+  if (listen_fd==-1) {
     ERR("Failed to create server TCP socket: %s\n",strerror(errno));
     exit(-1);
   }
   int reuseaddr=1;
-  setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&reuseaddr,sizeof(reuseaddr));
+  setsockopt(listen_fd,SOL_SOCKET,SO_REUSEADDR,&reuseaddr,sizeof(reuseaddr));
+  if (num_procs>1) setsockopt(listen_fd,SOL_SOCKET,SO_REUSEPORT,&reuseaddr,sizeof(reuseaddr)); // kernel shares out connections
 
   struct sockaddr_in addr;
   addr.sin_addr.s_addr = INADDR_ANY;
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
-  if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr))==-1) {
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr))==-1) {
     ERR("Failed to bind TCP socket: %s\n",strerror(errno));
     exit(-1);
   }
-  if (listen(server_fd,SOMAXCONN)) {
+  if (listen(listen_fd,SOMAXCONN)) {
     ERR("Failed to listen for TCP connections: %s\n",strerror(errno));
     exit(-1);
   }
-  printf("Listening on TCP port %d\n",port);
 
-  // loop indefinitely and wait for HTTP connections
-  while (1) {
-    int session_fd=accept(server_fd,0,0);
-    if (session_fd==-1) {
-      ERR("Failed to accept TCP connection: %s\n",strerror(errno));
-      continue;
+  // each I/O thread has its own epoll set.  all of them watch the listening socket, EPOLLEXCLUSIVE
+  // means only one is woken per new connection
+  int i;
+  io_threads = calloc(num_io_threads, sizeof(IOThread));
+  for (i=0; i<num_io_threads; i++) {
+    IOThread *io = &io_threads[i];
+    io->id = i;
+    pthread_mutex_init(&io->done_mutex, NULL);
+    io->epoll_fd = epoll_create1(0);
+    io->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (io->epoll_fd<0 || io->event_fd<0) {
+      ERR("Failed to create epoll set: %s\n",strerror(errno));
+      exit(-1);
     }
-
-    // GPU can run only one darknet process at a time, so we need to serialise web requests.
-    pthread_t thread_id; 
-    pthread_mutex_lock(&active_mutex);
-    Params p;
-    if (active) {
-       pthread_mutex_unlock(&active_mutex);
-       close_session(&session_fd,session_fd,NULL,0,NULL,0);
-    } else {
-       active=1; // flag GPU as busy.
-       pthread_mutex_unlock(&active_mutex);
-       p.session_fd = session_fd; p.send_fd=session_fd; p.slen=0; p.ptr=0; 
-       if( pthread_create( &thread_id , NULL , handle_connection, (void*) &p) < 0) {
-         ERR("Failed to create thread\n");
-         close_session(&session_fd,session_fd,NULL,0,NULL,0);
-         active=0; // flag GPU as free. no need for mutex here.
-       }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listen_marker;
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev)<0) {
+      ERR("Failed to add listening socket to epoll set: %s\n",strerror(errno));
+      exit(-1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = io;
+    epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->event_fd, &ev);
+    if (i>0 && pthread_create(&io->thread, NULL, io_thread, (void*)io) != 0) {
+      ERR("Failed to create I/O thread %d\n", i);
+      exit(-1);
     }
   }
+  printf("Listening on TCP port %d\n",port);
 
-  close(server_fd);
+  // and this thread becomes I/O thread 0
+  io_thread(&io_threads[0]);
+  close(listen_fd);
+  return NULL;
 }
 
+// UDP requests: the client splits an HTTP request into datagrams, each starting with a 2 byte
+// (little-endian) packet index.  All packets except the last carry the same amount of data (the stride),
+// so packet i holds bytes i*stride onwards of the request and can be copied straight to its place in
+// the POST data buffer, whatever order it arrives in.  The HTTP headers must fit in packet 0.
+// A single thread pulls packets off the socket in batches and keeps a session for each client
+// address/port, so several cameras can be sending at once.  When all of a session's packets are in, the
+// request goes to the workers and the worker sends the response straight back to the client.  The
+// session then hangs around for RECV_TIMEOUT so that late duplicates don't look like a new request.  The header
+// has no request id, so a late duplicate is told from the start of the client's next request (which may arrive
+// before its packet 0) by comparing it with a hash of the finished request's packet at that index.
+#define UDP_BATCH 32 // max datagrams read per recvmmsg() call
+#define UDP_MAX_SESSIONS 64 // max UDP requests being reassembled at once
+#define UDP_MAX_PKTS 65536 // packet index is 16 bits
+#define UDP_EARLY_PKTS 32 // max packets held while waiting for packet 0 of a request
+#define UDP_RCVBUF (4*1024*1024) // socket receive buffer, to ride out bursts from several clients
+#define BUFLEN 1500
+
+typedef struct UdpSession {
+  int active;
+  int finished; // request has gone to the workers, session kept a while to soak up duplicate packets
+  uint32_t *hashes; // hash of each packet received (a pool buffer), kept once finished to spot late duplicates
+  int done_npkts; // packets in the finished request
+  struct sockaddr_in addr; // client address
+  struct timespec last_pkt; // when last packet arrived, for timeout
+  Request *r; // NULL until packet 0 has arrived
+  int head_len; // length of HTTP headers at start of packet 0
+  int stride; // payload size of all but the last packet
+  int npkts, nrecvd;
+  uint64_t recvd[UDP_MAX_PKTS/64]; // bitmap of packets received
+  char *early; // packets that arrived before packet 0, BUFLEN bytes per slot
+  int early_index[UDP_EARLY_PKTS], early_len[UDP_EARLY_PKTS], nearly;
+} UdpSession;
+
+UdpSession udp_sessions[UDP_MAX_SESSIONS];
+int udp_nactive=0; // number of sessions in use
+
 int get_pkt_index(unsigned char* buf) {
    // read packet index out of our header (first 2 bytes of UDP payload)
-   // (for in-order delivery book-keeping)
    return  ((int)buf[1])*256+(int)buf[0];
 }
 
-void dump_reassembly_state(reassembly_info *r_info) {
-   INFO("next=%d, highest=%d, buffered=", r_info->nxt_pkt_index,r_info->highest_pkt_index);
+void udp_reply(struct sockaddr_in *addr, char *msg, int len) {
+   // send response to UDP client, or empty response (tells client to give up on request) if msg is NULL
+   if (msg==NULL) {
+      DEBUG_UDP("closing UDP session, sending empty pkt\n");
+      msg="[]"; len=2;
+   }
+   // send a couple of extra copies, in case of loss (extras will be ignored by client)
    int i;
-   for (i=r_info->nxt_pkt_index; i< r_info->nxt_pkt_index+REASSEMBLY_SIZE; i++) {
-      if (i > r_info->highest_pkt_index) break;
-      if (r_info->reassembly_buf[i%REASSEMBLY_SIZE]) INFO("%d ",i);
+   for (i=0; i<3; i++) {
+      if (sendto(udp_fd,msg,len,0,(struct sockaddr*)addr,sizeof(*addr))<0) {
+         ERR("Failed to send UDP response: %s\n",strerror(errno));
+         break;
+      }
    }
-   INFO("\n");
 }
 
-void init_reassembly_state(reassembly_info *r_info) {
-    r_info->nxt_pkt_index=0;
-    r_info->highest_pkt_index=0;
-    memset(r_info->reassembly_buf,0,REASSEMBLY_SIZE*sizeof(char*)); // initialise reassembly buffer
+void udp_request_done(Request *r) {
+   // called by a worker once a UDP request has been processed
+   if (r->response) DEBUG_JSON("%s\n", r->response);
+   udp_reply(&r->udp_addr, r->response, r->response_len);
+   response_sent(r->starttime, r->t_done, r->status ? r->status : r->response ? 200 : 400, r->response_len);
+   pool_put(r->post_data); pool_put(r->response);
+   free(r);
 }
 
-void clear_reassembly_state(reassembly_info *r_info) {
-    int i;
-    for (i=r_info->nxt_pkt_index+1; i<=r_info->highest_pkt_index; i++) {
-       if (r_info->reassembly_buf[i%REASSEMBLY_SIZE]!=NULL) {
-          free(r_info->reassembly_buf[i%REASSEMBLY_SIZE]);
-          r_info->reassembly_buf[i%REASSEMBLY_SIZE]=NULL;
-       }
-    }
-    r_info->nxt_pkt_index=0;
-    r_info->highest_pkt_index=0;
-    memset(r_info->reassembly_buf,0,REASSEMBLY_SIZE*sizeof(char*)); // initialise reassembly buffer
+void udp_end_session(UdpSession *s);
+
+UdpSession* udp_find_session(struct sockaddr_in *addr) {
+   // find session for client address, starting a new one if need be.  NULL if too many sessions
+   static UdpSession *last=NULL; // packets tend to come in runs from the same client
+   if (last && last->active && last->addr.sin_addr.s_addr==addr->sin_addr.s_addr && last->addr.sin_port==addr->sin_port) {
+      return last;
+   }
+   UdpSession *s, *free_s=NULL, *finished_s=NULL;
+   for (s=udp_sessions; s<udp_sessions+UDP_MAX_SESSIONS; s++) {
+      if (s->active && s->addr.sin_addr.s_addr==addr->sin_addr.s_addr && s->addr.sin_port==addr->sin_port) {
+         return last=s; // even if finished, it has to see late packets of the client's last request
+      }
+      if (!s->active) {
+         if (!free_s) free_s=s;
+      } else if (s->finished && !finished_s) {
+         finished_s=s;
+      }
+   }
+   if (free_s==NULL && finished_s) { // all in use, but can drop one that's just hanging around
+      udp_end_session(finished_s);
+      free_s=finished_s;
+   }
+   if ((s=free_s)==NULL) return NULL;
+   s->active=1; s->finished=0; s->addr=*addr; s->r=NULL; s->nearly=0; s->hashes=NULL;
+   udp_nactive++;
+   return last=s;
+}
+
+void udp_clear_session(UdpSession *s) {
+   // get session ready for next request
+   if (s->r) { // request wasn't completed
+      pool_put(s->r->post_data); free(s->r); s->r=NULL;
+   }
+   pool_put(s->early); s->early=NULL;
+   pool_put((char*)s->hashes); s->hashes=NULL;
+   memset(s->recvd, 0, (s->npkts+63)/64*sizeof(uint64_t));
+   s->npkts=s->nrecvd=s->nearly=0;
+}
+
+void udp_end_session(UdpSession *s) {
+   udp_clear_session(s);
+   s->active=0;
+   udp_nactive--;
+}
+
+uint32_t udp_hash(char *buf, int len) {
+   // FNV-1a
+   uint32_t h=2166136261u;
+   int i;
+   for (i=0; i<len; i++) h = (h^(unsigned char)buf[i])*16777619u;
+   return h;
+}
+
+void udp_answer(Request *r) {
+   // answer a request that has no POST data (stats, metrics or reload) straight away
+   char json[4*BUFFER_SIZE];
+   if (r->endpoint == EP_RELOAD) {
+      request_reload(r->model);
+      strcpy(json, "{\"reload\": \"started\"}");
+   } else if (r->endpoint == EP_STATS) {
+      stats_json(json, sizeof(json));
+   } else {
+      metrics_json(json, sizeof(json));
+   }
+   udp_reply(&r->udp_addr, json, strlen(json));
+}
+
+int udp_start(UdpSession *s, char *payload, int len) {
+   // packet 0 has arrived, parse the HTTP headers and get a buffer for the POST data.  returns -1 if bad, 1 if the
+   // request had no POST data and has been answered already
+   Request *r = calloc(1, sizeof(Request));
+   r->starttime = NOW;
+   r->udp_addr = s->addr;
+   HttpParser p;
+   http_init(&p);
+   int res = http_parse_head(&p, payload, len, r);
+   if (res==0) {
+      ERR("UDP request headers don't fit in first packet\n");
+   } else if (res>0 && p.chunked) {
+      ERR("Chunked POST data not supported over UDP\n");
+   } else if (res>0 && p.content_length > MAXLEN) {
+      ERR("POST data too large (%ld bytes)\n", p.content_length);
+   } else if (res>0 && (r->endpoint==EP_STATS || r->endpoint==EP_METRICS || r->endpoint==EP_RELOAD)) {
+      udp_answer(r);
+      free(r);
+      return 1;
+   } else if (res>0 && r->endpoint!=EP_DUMMY) {
+      r->len = p.content_length;
+      r->post_data = pool_get(r->len);
+   }
+   if (r->post_data==NULL) {
+      free(r);
+      return -1;
+   }
+   long total = p.posn + p.content_length; // size of whole HTTP request
+   s->head_len = p.posn;
+   s->stride = len;
+   s->npkts = (total+len-1)/len;
+   if (s->npkts > UDP_MAX_PKTS) {
+      ERR("UDP request needs %d packets, max is %d\n", s->npkts, UDP_MAX_PKTS);
+      pool_put(r->post_data); free(r);
+      s->npkts=0;
+      return -1;
+   }
+   s->hashes = (uint32_t*)pool_get(s->npkts*sizeof(uint32_t));
+   if (s->hashes==NULL) {
+      pool_put(r->post_data); free(r);
+      s->npkts=0;
+      return -1;
+   }
+   s->r = r;
+   return 0;
 }
 
-void process_pkt_inorder(char* buf, int len, int fd, int send_fd, reassembly_info *r_info) {
-   // process incoming UDP packets, buffering as needed to ensure in-order delivery
-   if (get_pkt_index(buf) > r_info->highest_pkt_index) r_info->highest_pkt_index=get_pkt_index(buf);
-   if (get_pkt_index(buf) == r_info->nxt_pkt_index) {
-      // in-order packet, send it on to handler
-      DEBUG_UDP("forwarding %d ",r_info->nxt_pkt_index);
-      if (send(fd,buf+2,len-2,0)<0) {
-         ERR("Pipe error: %s\n",strerror(errno));
+void udp_place(UdpSession *s, int index, char *payload, int len) {
+   // copy POST data in packet to its place in the request
+   if (index >= s->npkts) {
+      WARN("UDP packet index %d out of range, request has %d packets\n", index, s->npkts);
+      return;
+   }
+   if (s->recvd[index/64] & (1ULL<<(index%64))) {
+      DEBUG_UDP("Duplicate packet, index=%d\n", index);
+      return;
+   }
+   long off = (long)index*s->stride;
+   long expect = index==s->npkts-1 ? s->head_len+s->r->len-off : s->stride;
+   if (len != expect) {
+      WARN("UDP packet %d has %d bytes, expected %ld\n", index, len, expect);
+      return;
+   }
+   int skip = off < s->head_len ? s->head_len-off : 0; // HTTP headers, only in packet 0
+   memcpy(s->r->post_data+off+skip-s->head_len, payload+skip, len-skip);
+   s->hashes[index] = udp_hash(payload, len);
+   s->recvd[index/64] |= 1ULL<<(index%64);
+   s->nrecvd++;
+}
+
+void udp_packet(char *buf, int len, struct sockaddr_in *addr, struct timespec *now) {
+   // handle an incoming datagram
+   if (len<2) return;
+   int index = get_pkt_index((unsigned char*)buf);
+   char *payload = buf+2; len-=2;
+   UdpSession *s = udp_find_session(addr);
+   if (s==NULL) {
+      // end connection if too busy, client will retry
+      WARN("Too many UDP sessions, rejecting packet %d from %s:%d\n", index, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+      udp_reply(addr, NULL, 0);
+      return;
+   }
+   DEBUG_UDP("received UDP packet %d (%d bytes) from %s:%d\n", index, len, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+   s->last_pkt = *now;
+   if (s->finished) {
+      if (index < s->done_npkts && udp_hash(payload, len)==s->hashes[index]) {
+         DEBUG_UDP("Late packet %d for finished request\n", index);
+         return;
+      }
+      s->finished=0; // client has started on next request, this may be any of its packets
+      pool_put((char*)s->hashes); s->hashes=NULL;
+   }
+   if (s->r==NULL && index>0) {
+      // don't know where it goes until packet 0 turns up, so hold on to it
+      if (s->nearly==UDP_EARLY_PKTS || len>BUFLEN) {
+         WARN("Too many packets before first packet of request (old connection? packet loss?)\n");
+         udp_reply(&s->addr, NULL, 0);
+         udp_end_session(s);
+         return;
+      }
+      if (s->early==NULL) s->early = pool_get(UDP_EARLY_PKTS*BUFLEN);
+      if (s->early==NULL) return;
+      memcpy(s->early+s->nearly*BUFLEN, payload, len);
+      s->early_index[s->nearly] = index;
+      s->early_len[s->nearly++] = len;
+      return;
+   }
+   if (s->r==NULL) { // packet 0
+      int res = udp_start(s, payload, len);
+      if (res<0) {
+         udp_reply(&s->addr, NULL, 0);
+         udp_end_session(s);
+         return;
+      }
+      if (res>0) { // answered, keep its hash so a duplicate isn't answered again
+         udp_clear_session(s);
+         s->hashes = (uint32_t*)pool_get(sizeof(uint32_t));
+         if (s->hashes) s->hashes[0] = udp_hash(payload, len);
+         s->done_npkts = s->hashes ? 1 : 0;
+         s->finished = 1;
+         return;
+      }
+      int i;
+      for (i=0; i<s->nearly; i++) udp_place(s, s->early_index[i], s->early+i*BUFLEN, s->early_len[i]);
+   }
+   udp_place(s, index, payload, len);
+
+   if (s->nrecvd == s->npkts) {
+      // have the whole request, pass it on to a worker
+      DEBUG_UDP("UDP request complete, %d packets\n", s->npkts);
+      Request *r = s->r;
+      uint32_t *hashes = s->hashes;
+      s->r = NULL; s->hashes = NULL;
+      s->done_npkts = s->npkts;
+      udp_clear_session(s);
+      s->hashes = hashes; // to recognise late duplicates
+      s->finished = 1;
+      if (save_to_file) dump_image(r->post_data, r->len);
+      submit_request(r);
+   }
+}
+
+void udp_expire(struct timespec *now) {
+   // give up on sessions that have gone quiet (packet loss)
+   UdpSession *s;
+   for (s=udp_sessions; s<udp_sessions+UDP_MAX_SESSIONS && udp_nactive>0; s++) {
+      if (!s->active) continue;
+      long us = (now->tv_sec-s->last_pkt.tv_sec)*1000000L + (now->tv_nsec-s->last_pkt.tv_nsec)/1000;
+      if (us > RECV_TIMEOUT && s->finished) {
+         udp_end_session(s);
+      } else if (us > RECV_TIMEOUT) {
+         INFO("Timeout on UDP request from %s:%d, got %d/%d packets (packet loss ?)\n",
+              inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port), s->nrecvd, s->npkts);
+         udp_reply(&s->addr, NULL, 0);
+         udp_end_session(s);
       }
-      r_info->nxt_pkt_index++;
-      // try to send any buffered packets
-      while (r_info->reassembly_buf[r_info->nxt_pkt_index%REASSEMBLY_SIZE]!=NULL) {
-         DEBUG_UDP(" %d ",r_info->nxt_pkt_index);
-         send(fd,
-            r_info->reassembly_buf[r_info->nxt_pkt_index%REASSEMBLY_SIZE]+2,
-            r_info->reassembly_buf_len[r_info->nxt_pkt_index%REASSEMBLY_SIZE]-2,0);
-         char* ptr = r_info->reassembly_buf[r_info->nxt_pkt_index%REASSEMBLY_SIZE];
-         r_info->reassembly_buf[r_info->nxt_pkt_index%REASSEMBLY_SIZE]=NULL;
-         free(ptr); // we cache the ptr in case a recv() timeout happens between the free() and setting to NULL
-         r_info->nxt_pkt_index++;
-       }
-       DEBUG_UDP("\n");
-    } else {  
-       if (get_pkt_index(buf) > r_info->nxt_pkt_index+REASSEMBLY_SIZE) {
-          // have run out of buffer space, drop packet and reset connection
-          //close_session(fd,send_fd,&si_other,slen,NULL,0);
-       } else if (get_pkt_index(buf) > r_info->nxt_pkt_index) {
-          // out of order packet, buffer it for now
-          if (r_info->reassembly_buf[get_pkt_index(buf)%REASSEMBLY_SIZE]!=NULL) {
-             WARN("Duplicate packet, index=%d, nxt=%d\n",get_pkt_index(buf),r_info->nxt_pkt_index);
-          } else {
-             r_info->reassembly_buf[get_pkt_index(buf)%REASSEMBLY_SIZE] = buf;
-             r_info->reassembly_buf_len[get_pkt_index(buf)%REASSEMBLY_SIZE] = len;
-             return; // don't free(buf)
-          }
-       } else {
-          WARN("Late packet, index=%d, nxt=%d\n",get_pkt_index(buf),r_info->nxt_pkt_index);
-       }
    }
-   free(buf);
 }
 
 void* accept_udp(void* param) {
-  // listen on UDP port for connections
+  // listen on UDP port for requests
   int port = *(int*)param;
 
   int server_fd=socket(AF_INET,SOCK_DGRAM,0);
@@ -879,6 +3725,9 @@ void* accept_udp(void* param) {
   }
   int reuseaddr=1;
   setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&reuseaddr,sizeof(reuseaddr));
+  if (num_procs>1) setsockopt(server_fd,SOL_SOCKET,SO_REUSEPORT,&reuseaddr,sizeof(reuseaddr)); // kernel shares out connections
+  int rcvbuf=UDP_RCVBUF;
+  setsockopt(server_fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
 
   struct sockaddr_in addr;
   addr.sin_addr.s_addr = INADDR_ANY;
@@ -888,99 +3737,176 @@ void* accept_udp(void* param) {
     ERR("Failed to bind UDP socket: %s\n",strerror(errno));
     exit(-1);
   }
-
-  int pipefd[2]; // pipe for multiplexing UDP connections
-  pipefd[0]=-1; pipefd[1]=-1;
-  struct sockaddr_in si_active; // the client address of the current active connection
-  // reassembly buffer for in-order delivery of UDP payloads
-  reassembly_info r_info; 
-  init_reassembly_state(&r_info);
+  udp_fd = server_fd;
+
+  // buffers for a batch of datagrams
+  static char bufs[UDP_BATCH][BUFLEN];
+  struct sockaddr_in addrs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  struct mmsghdr msgs[UDP_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  int i;
+  for (i=0; i<UDP_BATCH; i++) {
+    iovs[i].iov_base = bufs[i]; iovs[i].iov_len = BUFLEN;
+    msgs[i].msg_hdr.msg_iov = &iovs[i]; msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+  }
 
   printf("Listening on UDP port %d\n",port);
 
-  // loop indefinitely and wait for connections
+  // loop indefinitely, waking up at least every RECV_TIMEOUT while requests are being received
   while (1) {
-    #define BUFLEN 1500
-    char *buf = malloc(BUFLEN);
-    struct sockaddr_in si_other;
-    int slen=sizeof(si_other);
-    int res=recvfrom(server_fd,buf,BUFLEN,0,(struct sockaddr *) &si_other, &slen);
-    char str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET,(struct inaddr *) &si_other.sin_addr, str, INET_ADDRSTRLEN);
-    DEBUG_UDP("received UDP %d from %s: %d\n",res, str, ntohs(si_other.sin_port));
-    if (res==-1) {
-      ERR("Failed to accept UDP connection: %s\n",strerror(errno));
-      free(buf);
-      continue;
+    struct pollfd pfd = {server_fd, POLLIN, 0};
+    int res = poll(&pfd, 1, udp_nactive ? RECV_TIMEOUT/1000 : -1);
+    if (res<0 && errno!=EINTR) {
+      ERR("UDP poll failed: %s\n",strerror(errno));
     }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int n=0;
+    if (res>0) do {
+      for (i=0; i<UDP_BATCH; i++) msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      n = recvmmsg(server_fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+      if (n<0) {
+        if (errno!=EAGAIN && errno!=EINTR) ERR("Failed to receive UDP packets: %s\n",strerror(errno));
+        break;
+      }
+      for (i=0; i<n; i++) udp_packet(bufs[i], msgs[i].msg_len, &addrs[i], &now);
+    } while (n==UDP_BATCH);
+    udp_expire(&now);
+  }
 
-    // GPU can run only one darknet process at a time, so we need to serialise web requests.
-    pthread_t thread_id;
-    pthread_mutex_lock(&active_mutex);
-    Params p;
-    if (active) {
-       pthread_mutex_unlock(&active_mutex);
-       // if packet is from the active connection we forward it to the handler thread via pipe
-       if ((si_other.sin_addr.s_addr == si_active.sin_addr.s_addr) && (si_other.sin_port == si_active.sin_port)) {
-          DEBUG_UDP("index=%d/%d\n",get_pkt_index(buf),r_info.nxt_pkt_index);
-          process_pkt_inorder(buf,res,pipefd[0],server_fd,&r_info);
-       } else {
-          // end connection if GPU busy, might be nicer to send a message
-          DEBUG_UDP("Resetting UDP connection (pkt_index=%d)\n",get_pkt_index(buf));
-          if (get_pkt_index(buf)==0) DEBUG_UDP("%60.60s\n",buf);
-          int fd=-1;
-          close_session(&fd,server_fd,&si_other,slen,NULL,0);
-          free(buf);
-       }
-    } else {
-       active=1; // flag GPU as busy.
-       pthread_mutex_unlock(&active_mutex);
-       if (get_pkt_index(buf) > 0) {
-         WARN("First packet %d of request is out of order (old connection? packet loss?)\n",get_pkt_index(buf));
-         int fd=-1;
-         close_session(&fd,server_fd,&si_other,slen,NULL,0);
-         active=0; free(buf);
-         continue;
-       }
-       // create pipe for multiplexing UDP connections
-       if (pipefd[0]!=-1) {close(pipefd[0]); pipefd[0]=-1;}
-       if (pipefd[1]!=-1) {close(pipefd[1]); pipefd[1]=-1;}
-       if (socketpair(AF_UNIX,SOCK_STREAM,0,pipefd)<0) {
-          ERR("Failed to create UDP pipe: %s\n", strerror(errno));
-          int fd=-1;
-          close_session(&fd,server_fd,&si_other,slen,NULL,0);
-          active=0; free(buf);
-          continue;
-       }
-       struct timeval timeout;
-       timeout.tv_sec = 0; timeout.tv_usec = RECV_TIMEOUT; // timeout of inter-packet delay greater than this
-       if (setsockopt (pipefd[1], SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
-          ERR("Pipe setsockopt failed\n");
-          close_session(&pipefd[1],server_fd,&si_other,slen,NULL,0);
-          active=0; close(pipefd[0]); pipefd[0]=-1; free(buf);
-          continue;
-       }
+  close(server_fd);
+}
 
-       memcpy(&si_active, &si_other, slen); // keep a note of the client address for connection
-       p.session_fd = pipefd[1]; p.send_fd=server_fd; p.si_active=si_other; p.slen=slen;
-       p.ptr = &r_info; // for debugging
-       if( pthread_create( &thread_id , NULL , handle_connection, (void*) &p) < 0) {
-         ERR("Failed to create thread\n");
-         close_session(&pipefd[1],server_fd,&si_other,slen,NULL,0);
-         active=0; close(pipefd[0]); pipefd[0]=-1; free(buf); 
-         continue;
-       }
+// Prefork mode (-P).  The master loads every model, moves its weights into shared read-only memory and forks the
+// server processes, which each bind the port with SO_REUSEPORT (so the kernel spreads connections and datagrams
+// across them) and run on their own share of the CPUs.  Only their activations and workspaces are private.  The
+// master restarts processes that die and passes SIGTERM on to them.  It does reloads itself (on SIGHUP, which the
+// processes send it for POST /reload), then restarts the processes one at a time so they all get the new weights.
+volatile sig_atomic_t forward_hup = 0, quitting = 0;
+
+void on_master_signal(int sig) {
+  if (sig==SIGHUP) forward_hup = 1;
+  else quitting = sig;
+}
 
-       // finally, we pass the request on to the handler via the pipe
-       send(pipefd[0],buf+2,res-2,0); // the +2 is because 1st two bytes of payload are pkt index
-       free(buf);
-       clear_reassembly_state(&r_info); // initialise reassembly buffer
-       r_info.nxt_pkt_index=1; // index of next in-order packet
-       DEBUG_UDP("index=%d\n",0);
+void master_reload() {
+  // reload the models in the master and move the new weights into shared memory, for the processes forked from now
+  // on.  the old mappings are freed here, processes still running keep their own references to them
+  int i;
+  for (i=0; i<num_models; i++) {
+    Model *m = &models[i];
+    if (!m->loaded || !model_reload(m) || !m->loaded) continue;
+    m->loaded->map = map_weights(m->loaded->net, &m->loaded->map_size);
+    if (!m->loaded->map) WARN("Failed to map weights of model %s into shared memory, each process will copy them\n", m->name);
+  }
+}
+
+pid_t fork_proc(int index, pid_t master) {
+  // start server process index.  returns its pid in the master, 0 in the new process
+  pid_t pid = fork();
+  if (pid==-1) {
+    ERR("Failed to fork server process %d: %s\n", index, strerror(errno));
+    exit(-1);
+  }
+  if (pid) return pid;
+  proc_index = index;
+  master_pid = master;
+  prctl(PR_SET_PDEATHSIG, SIGTERM); // go when the master does
+  if (getppid()!=master) exit(0);
+  signal(SIGHUP, SIG_IGN); // until init_workers() sets up reloading
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  cpu_set_t all, mine;
+  if (sched_getaffinity(0, sizeof(all), &all)==0) {
+    // the nth of the CPUs we may use goes to process n*num_procs/ncpu, or with fewer CPUs than processes
+    // process i gets CPU i%ncpu
+    int i, n = 0, ncpu = CPU_COUNT(&all);
+    CPU_ZERO(&mine);
+    for (i=0; i<CPU_SETSIZE && n<ncpu; i++) {
+      if (!CPU_ISSET(i, &all)) continue;
+      if (ncpu>=num_procs ? n*num_procs/ncpu==index : n==index%ncpu) CPU_SET(i, &mine);
+      n++;
+    }
+    if (sched_setaffinity(0, sizeof(mine), &mine)==-1) {
+      WARN("Failed to set CPU affinity of server process %d: %s\n", index, strerror(errno));
     }
+    INFO("Server process %d (pid %d) on %d CPUs\n", index, getpid(), CPU_COUNT(&mine));
   }
+  return 0;
+}
 
-  close(server_fd);
+void prefork() {
+  // load the models and fork the server processes.  returns in each of them, the master never returns
+  int i, rolling = num_procs, reroll = 0; // process being restarted after a reload, num_procs if none
+  pid_t master = getpid();
+  pid_t *procs = calloc(num_procs, sizeof(pid_t));
+  long *started = calloc(num_procs, sizeof(long));
+  for (i=0; i<num_models; i++) {
+    Model *m = &models[i];
+    pthread_mutex_lock(&models_mutex);
+    model_load(m);
+    pthread_mutex_unlock(&models_mutex);
+    m->loaded->map = map_weights(m->loaded->net, &m->loaded->map_size);
+    if (!m->loaded->map) WARN("Failed to map weights of model %s into shared memory, each process will copy them\n", m->name);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_master_signal; // no SA_RESTART, so it wakes up waitpid()
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  for (i=0; i<num_procs; i++) {
+    started[i] = now_us();
+    if (!(procs[i] = fork_proc(i, master))) return;
+  }
+  INFO("Started %d server processes\n", num_procs);
+  for (;;) {
+    int status;
+    if (quitting) {
+      INFO("Stopping server processes\n");
+      for (i=0; i<num_procs; i++) kill(procs[i], SIGTERM);
+      exit(0);
+    }
+    if (forward_hup) {
+      // reload before restarting anything, so even a process restarted after a crash gets the new weights
+      forward_hup = 0;
+      master_reload();
+      if (rolling<num_procs) {
+        reroll = 1; // those already restarted have the previous reload, go round again
+      } else {
+        INFO("Restarting server processes with the reloaded models\n");
+        kill(procs[rolling = 0], SIGTERM);
+      }
+    }
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid==-1) {
+      if (errno!=EINTR) {
+        ERR("waitpid failed: %s\n", strerror(errno));
+        exit(-1);
+      }
+      continue;
+    }
+    for (i=0; i<num_procs && procs[i]!=pid; i++);
+    if (i==num_procs) continue;
+    if (i==rolling) {
+      // stopped for a reload.  the others keep serving until it's back, then the next goes
+      started[i] = now_us();
+      if (!(procs[i] = fork_proc(i, master))) return;
+      if (++rolling==num_procs && reroll) rolling = reroll = 0;
+      if (rolling<num_procs) kill(procs[rolling], SIGTERM);
+      continue;
+    }
+    if (WIFSIGNALED(status)) {
+      WARN("Server process %d (pid %d) killed by signal %d, restarting it\n", i, pid, WTERMSIG(status));
+    } else {
+      WARN("Server process %d (pid %d) exited with status %d, restarting it\n", i, pid, WEXITSTATUS(status));
+    }
+    if (now_us()-started[i] < 1000000) sleep(1); // don't spin if it dies straight away
+    started[i] = now_us();
+    if (!(procs[i] = fork_proc(i, master))) return;
+  }
 }
 
 int main(int argc, char **argv) {
@@ -988,18 +3914,15 @@ int main(int argc, char **argv) {
   char *model_file = DEFAULT_CONFIG_MODEL;
   char *weights_file = DEFAULT_MODEL_WEIGHTS;
   char *names_file = DEFAULT_MODEL_NAMES;
-  int w = DEFAULT_DIM, h = DEFAULT_DIM;
+  char *model_list = NULL;
+  char *sizes = NULL;
   int port = DEFAULT_PORT;
   char c;
-  while ((c = (char)getopt(argc, argv,"p:m:w:n:v::hd:sd:")) != EOF) {
+  while ((c = (char)getopt(argc, argv,"p:m:w:n:v::hd:sd:t:i:b:l:D:Q:c:o:S:M:B:P:")) != EOF) {
     switch(c) {
       case 'd':
-        // set input size of network
-        w = atoi(optarg); h=w;
-        if (w%32 || h%32) {
-           ERR("network width %d and height %d must be a multiple of 32\n",w,h);
-           exit(-1);
-        } 
+        // set input size of network, or several to choose from
+        sizes = optarg;
         break;
       case 'p':
         port = atoi(optarg);
@@ -1008,6 +3931,86 @@ int main(int argc, char **argv) {
           exit(-1);
         }
         break;
+      case 't':
+        num_workers = atoi(optarg);
+        if (num_workers < 1) {
+          ERR("Invalid number of workers %d\n", num_workers);
+          exit(-1);
+        }
+        break;
+      case 'c':
+        num_decoders = atoi(optarg);
+        if (num_decoders < 1) {
+          ERR("Invalid number of decode threads %d\n", num_decoders);
+          exit(-1);
+        }
+        break;
+      case 'o':
+        num_posters = atoi(optarg);
+        if (num_posters < 1) {
+          ERR("Invalid number of NMS/response threads %d\n", num_posters);
+          exit(-1);
+        }
+        break;
+      case 'i':
+        num_io_threads = atoi(optarg);
+        if (num_io_threads < 1) {
+          ERR("Invalid number of I/O threads %d\n", num_io_threads);
+          exit(-1);
+        }
+        break;
+      case 'b':
+        batch_size = atoi(optarg);
+        if (batch_size < 1 || batch_size > MAX_BATCH) {
+          ERR("Invalid batch size %d, must be 1 to %d\n", batch_size, MAX_BATCH);
+          exit(-1);
+        }
+        break;
+      case 'l':
+        batch_window = atof(optarg)*1000;
+        if (batch_window < 0) {
+          ERR("Invalid batch window %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'D':
+        default_deadline = atoi(optarg);
+        if (default_deadline < 0) {
+          ERR("Invalid deadline %d\n", default_deadline);
+          exit(-1);
+        }
+        break;
+      case 'Q':
+        max_queue = atoi(optarg);
+        if (max_queue < 1) {
+          ERR("Invalid queue length %d\n", max_queue);
+          exit(-1);
+        }
+        break;
+      case 'S':
+        repeat_threshold = atof(optarg);
+        if (repeat_threshold < 0 || repeat_threshold > 255) {
+          ERR("Invalid repeat threshold %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'M':
+        model_list = optarg;
+        break;
+      case 'B':
+        memory_budget = atof(optarg)*1024*1024;
+        if (atof(optarg) < 0) {
+          ERR("Invalid memory budget %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'P':
+        num_procs = atoi(optarg);
+        if (num_procs < 1) {
+          ERR("Invalid number of processes %d\n", num_procs);
+          exit(-1);
+        }
+        break;
       case 'm':
         model_file = optarg;
         break;
@@ -1038,11 +4041,25 @@ int main(int argc, char **argv) {
 
   //gpu_index=-1; // disable use of gpu
 #ifdef GPU
+  if (num_procs>1 && gpu_index>=0) {
+    // the models would be loaded onto the GPU before forking, and the children can't use the parent's CUDA context
+    ERR("Prefork mode (-P) doesn't work with the GPU, build with GPU=0 to use it\n");
+    exit(-1);
+  }
   cuda_set_device(gpu_index);
 #endif
 
-  net = init(model_file, weights_file, w, h);
-  names = get_labels(names_file);
+  if (model_list) {
+    if (read_models(model_list)<0) exit(-1);
+  } else { // just the one, named after its cfg file
+    char name[256], *slash = strrchr(model_file, '/');
+    snprintf(name, sizeof(name), "%s", slash ? slash+1 : model_file);
+    char *dot = strrchr(name, '.');
+    if (dot) *dot = 0;
+    if (add_model(name, model_file, weights_file, names_file, sizes ? sizes : STR(DEFAULT_DIM))<0) exit(-1);
+  }
+  if (num_procs>1) prefork();
+  init_workers();
 
   // create thread to listen for TCP http connections
   pthread_t tcp_thread;
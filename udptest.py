@@ -0,0 +1,59 @@
+# check UDP request reassembly against a running server, with two clients interleaved and a late duplicate:
+# client X sends frame A, client Y sends one too (so X's session isn't the last one the server saw), then X sends
+# a late duplicate of one of A's packets followed by frame B with its packet 0 last.  X must get the same answer
+# for B as a client sending B on its own.  frames need to be 4+ packets and differ, e.g. two different photos
+# usage: python3 udptest.py a.jpg b.jpg [host] [port]
+
+import sys
+import time
+import socket
+
+PAYLOAD = 1400 # bytes of request per packet, after the 2 byte index (as the Android client)
+
+def packets(filename):
+    # split an edge_app3 request for the image into UDP packets
+    img = open(filename, 'rb').read()
+    req = b"POST /api/edge_app3 HTTP/1.1\r\nContent-Length: %d\r\n\r\n" % len(img) + img
+    return [bytes((i & 255, i >> 8)) + req[k:k+PAYLOAD] for i, k in enumerate(range(0, len(req), PAYLOAD))]
+
+def responses(s, want=None, timeout=10):
+    # distinct responses on s until want turns up or nothing more arrives (the server sends each one 3 times)
+    got = set()
+    s.settimeout(timeout)
+    while want is None or want not in got:
+        try:
+            got.add(s.recvfrom(65536)[0])
+        except socket.timeout:
+            break
+        if want is None:
+            s.settimeout(0.5)
+    return got
+
+if len(sys.argv) < 3:
+    print("usage: python3 udptest.py a.jpg b.jpg [host] [port]")
+    exit(-1)
+server = (sys.argv[3] if len(sys.argv) > 3 else "127.0.0.1", int(sys.argv[4]) if len(sys.argv) > 4 else 8000)
+A, B = packets(sys.argv[1]), packets(sys.argv[2])
+if len(A) < 4 or len(B) < 4:
+    print("frames must take at least 4 packets")
+    exit(-1)
+
+ref = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+for p in B: ref.sendto(p, server)
+expect = responses(ref)
+if len(expect) != 1:
+    print("no answer for B on its own")
+    exit(-1)
+expect = expect.pop()
+
+X = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+Y = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+for p in A: X.sendto(p, server)
+time.sleep(0.005)
+for p in A: Y.sendto(p, server)
+X.sendto(A[3], server) # late duplicate
+for p in B[1:] + B[:1]: X.sendto(p, server)
+
+ok = expect in responses(X, expect)
+print("interleaved clients with late duplicate: %s" % ("ok" if ok else "FAILED, wrong or no answer for B"))
+exit(0 if ok else 1)